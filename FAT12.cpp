@@ -1,9 +1,20 @@
 #include "string.h"
+#include <stddef.h>
 #include "FAT12.h"
 #include <stdio.h>
 
 #include "PrintfMacros.h"
 
+#ifdef FAT12_HOST
+#include <atomic>
+#include <thread>
+#include <vector>
+#endif
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
 Result<uint16_t> FAT12::GetFAT12_entry(size_t index)
 {
 
@@ -13,7 +24,7 @@ Result<uint16_t> FAT12::GetFAT12_entry(size_t index)
     size_t bitsintobytes = offset_bits%8;
     size_t offset_bytes = offset_bits/8;
     
-    size_t disk_offset = (bpb.BPB_RsvdSecCnt * bpb.BPB_BytsPerSec) + offset_bytes;
+    size_t disk_offset = OffsetToFat() + offset_bytes;
 
 
     
@@ -25,20 +36,67 @@ Result<uint16_t> FAT12::GetFAT12_entry(size_t index)
     return {(int)Fat12Status::OK,number};
 }
 
-Result<uint16_t> FAT12::GetFAT12_reverse_entry(size_t value)
+Result<uint32_t> FAT12::GetFAT_entry(size_t index)
 {
+    if(fattype == FatType::FAT12){
+        auto entry = GetFAT12_entry(index);
+        return {entry.status,entry.val};
+    }
+    if(!(index < GetNumberOfValidFatEntries()))return {(int)Fat12Status::INDEX_OUT_OF_RANGE};
+    if(fattype == FatType::FAT16){
+        uint16_t number;
+        memcpy(&number,disk + OffsetToFat() + index*2,sizeof(number));
+        return {(int)Fat12Status::OK,number};
+    }
+    uint32_t number;
+    memcpy(&number,disk + OffsetToFat() + index*4,sizeof(number));
+    return {(int)Fat12Status::OK,number & FAT32_ENTRY_MASK};
+}
 
-    for(uint16_t i = 2; i < GetNumberOfValidFatEntries(); i++){
-        auto entry = GetFAT12_entry(i);
-        if(!entry.Ok()){
-            return {(int)Fat12Status::ERROR};
-        }
-        if(entry.val == value){
-            return {(int)Fat12Status::OK,i};
+Result<none> FAT12::SetFAT_entry(size_t index, uint32_t value)
+{
+    if(index >= 2 && (index < freescancursor || value == 0)){
+        auto old = GetFAT_entry(index);
+        if(!old.Ok())return {old.status};
+        if(index < freescancursor && (old.val == 0) != (value == 0)){
+            freecount += value == 0 ? 1 : -1;
         }
+        if(value == 0 && index < freehint)freehint = index;
+    }
+    if(fattype == FatType::FAT12){
+        return SetFAT12_entry(index,value);
+    }
+    if(!(index < GetNumberOfValidFatEntries()))return {(int)Fat12Status::INDEX_OUT_OF_RANGE};
+    if(fattype == FatType::FAT16){
+        uint16_t number = value;
+        WriteFatBytes(index*2,&number,sizeof(number));
+        return {(int)Fat12Status::OK};
+    }
+    // The top 4 bits of a FAT32 entry are reserved and must be preserved.
+    uint32_t number;
+    memcpy(&number,disk + OffsetToFat() + index*4,sizeof(number));
+    number = (number & ~FAT32_ENTRY_MASK) | (value & FAT32_ENTRY_MASK);
+    WriteFatBytes(index*4,&number,sizeof(number));
+    return {(int)Fat12Status::OK};
+}
+
+// Writes the same bytes into every FAT copy so the copies never diverge.
+void FAT12::WriteFatBytes(size_t offset_in_fat, const void *src, size_t len)
+{
+    size_t fatbytes = (size_t)FatSectors() * bpb.BPB_BytsPerSec;
+    for(size_t i = 0; i < bpb.BPB_NumFATs; i++){
+        WriteDisk(OffsetToFat() + i*fatbytes + offset_in_fat,src,len);
     }
+}
+
+Result<uint32_t> FAT12::GetFAT_reverse_entry(uint32_t value)
+{
 
-    return {(int)Fat12Status::OK,END_OF_FILE};
+    auto found = FindFatEntry(value,2);
+    if(!found.Ok()){
+        return {(int)Fat12Status::ERROR};
+    }
+    return {(int)Fat12Status::OK,found.val};
 }
 
 Result<none> FAT12::SetFAT12_entry(size_t index, uint16_t value)
@@ -50,7 +108,7 @@ Result<none> FAT12::SetFAT12_entry(size_t index, uint16_t value)
     size_t offset_bytes = offset_bits/8;
     
     bool odd = index%2;
-    size_t disk_offset = (bpb.BPB_RsvdSecCnt * bpb.BPB_BytsPerSec) + offset_bytes;
+    size_t disk_offset = OffsetToFat() + offset_bytes;
 
     
     uint16_t twobytes;
@@ -64,11 +122,190 @@ Result<none> FAT12::SetFAT12_entry(size_t index, uint16_t value)
     }
     twobytes |= value;
 
-    memcpy(disk+disk_offset,&twobytes,sizeof(twobytes));
+    WriteFatBytes(offset_bytes,&twobytes,sizeof(twobytes));
+
+    return {(int)Fat12Status::OK};
+}
+
+// Unpacks 3-byte groups into pairs of 12-bit entries. Entry 2k lives in the
+// low 12 bits of bytes {3k,3k+1}, entry 2k+1 in the high 12 bits of {3k+1,3k+2}.
+void FAT12::DecodeFAT12Pairs(const uint8_t *src, size_t pairs, uint16_t *out)
+{
+    size_t p = 0;
+#if defined(__AVX2__)
+    // 8 pairs (24 bytes) per iteration, each 128-bit lane gets 12 bytes. The
+    // second load reads 4 bytes past the group, so keep 10 pairs of headroom.
+    const __m256i shuf256 = _mm256_setr_epi8(
+        0,1,1,2,3,4,4,5,6,7,7,8,9,10,10,11,
+        0,1,1,2,3,4,4,5,6,7,7,8,9,10,10,11);
+    const __m256i even256 = _mm256_set1_epi32(0x00000fff);
+    const __m256i odd256 = _mm256_set1_epi32(0x0fff0000);
+    for(; p + 10 <= pairs; p += 8){
+        __m128i lo = _mm_loadu_si128((const __m128i*)(src + p*3));
+        __m128i hi = _mm_loadu_si128((const __m128i*)(src + p*3 + 12));
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo),hi,1);
+        v = _mm256_shuffle_epi8(v,shuf256);
+        __m256i r = _mm256_or_si256(
+            _mm256_and_si256(v,even256),
+            _mm256_and_si256(_mm256_srli_epi16(v,4),odd256));
+        _mm256_storeu_si256((__m256i*)(out + p*2),r);
+    }
+#endif
+#if defined(__SSSE3__)
+    // 4 pairs (12 bytes) per iteration, the load reads 16 bytes.
+    const __m128i shuf = _mm_setr_epi8(0,1,1,2,3,4,4,5,6,7,7,8,9,10,10,11);
+    const __m128i even = _mm_set1_epi32(0x00000fff);
+    const __m128i odd = _mm_set1_epi32(0x0fff0000);
+    for(; p + 6 <= pairs; p += 4){
+        __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + p*3)),shuf);
+        __m128i r = _mm_or_si128(
+            _mm_and_si128(v,even),
+            _mm_and_si128(_mm_srli_epi16(v,4),odd));
+        _mm_storeu_si128((__m128i*)(out + p*2),r);
+    }
+#endif
+    // Portable SWAR: three 32-bit words hold 8 entries.
+    for(; p + 4 <= pairs; p += 4){
+        uint32_t w[3];
+        memcpy(w,src + p*3,sizeof(w));
+        uint16_t* o = out + p*2;
+        o[0] = w[0] & 0xfff;
+        o[1] = (w[0] >> 12) & 0xfff;
+        o[2] = (w[0] >> 24) | ((w[1] & 0x00f) << 8);
+        o[3] = (w[1] >> 4) & 0xfff;
+        o[4] = (w[1] >> 16) & 0xfff;
+        o[5] = (w[1] >> 28) | ((w[2] & 0x0ff) << 4);
+        o[6] = (w[2] >> 8) & 0xfff;
+        o[7] = w[2] >> 20;
+    }
+    for(; p < pairs; p++){
+        const uint8_t* g = src + p*3;
+        out[p*2] = g[0] | ((g[1] & 0x0f) << 8);
+        out[p*2+1] = (g[1] >> 4) | (g[2] << 4);
+    }
+}
+
+Result<none> FAT12::DecodeFatEntries(size_t first, uint32_t *out, size_t count)
+{
+    if(!out)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    if(first + count > GetNumberOfValidFatEntries())return {(int)Fat12Status::INDEX_OUT_OF_RANGE};
+
+    const uint8_t* fat = disk + OffsetToFat();
+    if(fattype == FatType::FAT16){
+        for(size_t i = 0; i < count; i++){
+            uint16_t number;
+            memcpy(&number,fat + (first+i)*2,sizeof(number));
+            out[i] = number;
+        }
+        return {(int)Fat12Status::OK};
+    }
+    if(fattype == FatType::FAT32){
+        memcpy(out,fat + first*4,count*4);
+        for(size_t i = 0; i < count; i++){
+            out[i] &= FAT32_ENTRY_MASK;
+        }
+        return {(int)Fat12Status::OK};
+    }
 
+    if(count > 0 && first%2){
+        auto head = GetFAT12_entry(first);
+        if(!head.Ok())return {head.status};
+        *out = head.val;
+        first++;
+        out++;
+        count--;
+    }
+    uint16_t pairs[FAT_DECODE_BLOCK];
+    for(size_t done = 0; done + 1 < count; ){
+        size_t n = MIN((size_t)FAT_DECODE_BLOCK,(count-done)&~(size_t)1);
+        DecodeFAT12Pairs(fat + ((first+done)/2)*3, n/2, pairs);
+        for(size_t i = 0; i < n; i++){
+            out[done+i] = pairs[i];
+        }
+        done += n;
+    }
+    if(count%2){
+        auto tail = GetFAT12_entry(first+count-1);
+        if(!tail.Ok())return {tail.status};
+        out[count-1] = tail.val;
+    }
     return {(int)Fat12Status::OK};
 }
 
+Result<uint32_t> FAT12::FindFatEntry(uint32_t value, size_t start)
+{
+    uint32_t block[FAT_DECODE_BLOCK];
+    size_t imax = GetNumberOfValidFatEntries();
+    for(size_t i = start; i < imax; i += FAT_DECODE_BLOCK){
+        size_t n = MIN((size_t)FAT_DECODE_BLOCK,imax-i);
+        if(!DecodeFatEntries(i,block,n).Ok())return {(int)Fat12Status::ERROR};
+        for(size_t j = 0; j < n; j++){
+            if(block[j] == value){
+                return {(int)Fat12Status::OK,(uint32_t)(i+j)};
+            }
+        }
+    }
+    return {(int)Fat12Status::OK,EndOfChain()};
+}
+
+Result<uint32_t> FAT12::FindFreeRun(size_t length, size_t start)
+{
+    uint32_t block[FAT_DECODE_BLOCK];
+    size_t imax = GetNumberOfValidFatEntries();
+    size_t runstart = 0;
+    size_t runlength = 0;
+    if(length == 0)return {(int)Fat12Status::ERROR};
+    for(size_t i = MAX(start,(size_t)freehint); i < imax; i += FAT_DECODE_BLOCK){
+        size_t n = MIN((size_t)FAT_DECODE_BLOCK,imax-i);
+        if(!DecodeFatEntries(i,block,n).Ok())return {(int)Fat12Status::ERROR};
+        for(size_t j = 0; j < n; j++){
+            if(block[j] != 0){
+                runlength = 0;
+                continue;
+            }
+            if(runlength == 0){
+                runstart = i+j;
+            }
+            runlength++;
+            if(runlength == length){
+                return {(int)Fat12Status::OK,(uint32_t)runstart};
+            }
+        }
+    }
+    return {(int)Fat12Status::OUT_OF_SPACE};
+}
+
+// Start of the longest free run; *length gets its length.
+Result<uint32_t> FAT12::LargestFreeRun(uint32_t *length)
+{
+    uint32_t block[FAT_DECODE_BLOCK];
+    size_t imax = GetNumberOfValidFatEntries();
+    uint32_t beststart = 0;
+    uint32_t runstart = 0;
+    uint32_t runlength = 0;
+    *length = 0;
+    for(size_t i = 2; i < imax; i += FAT_DECODE_BLOCK){
+        size_t n = MIN((size_t)FAT_DECODE_BLOCK,imax-i);
+        if(!DecodeFatEntries(i,block,n).Ok())return {(int)Fat12Status::ERROR};
+        for(size_t j = 0; j < n; j++){
+            if(block[j] != 0){
+                runlength = 0;
+                continue;
+            }
+            if(runlength == 0){
+                runstart = i+j;
+            }
+            runlength++;
+            if(runlength > *length){
+                beststart = runstart;
+                *length = runlength;
+            }
+        }
+    }
+    if(*length == 0)return {(int)Fat12Status::OUT_OF_SPACE};
+    return {(int)Fat12Status::OK,beststart};
+}
+
 Result<none> FAT12::ReadFirst512bytes(BPB *out)
 {
     if(!out)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
@@ -91,8 +328,11 @@ Result<none> FAT12::ReadFirst512bytes(BPB *out)
 
 Result<none> FAT12::InitFAT()
 {    
-    SetFAT12_entry(0,0xFF8);
-    SetFAT12_entry(1,0xFFF);
+    SetFAT_entry(0,EndOfChain() & ~7u);
+    SetFAT_entry(1,EndOfChain());
+    if(fattype == FatType::FAT32){
+        SetFAT_entry(bpb32.BPB_RootClus,EndOfChain());
+    }
 
     return {(int)Fat12Status::OK};
     
@@ -100,8 +340,8 @@ Result<none> FAT12::InitFAT()
 
 FatIterator FAT12::IterateFat(FatIterator *it)
 {
-    FatIterator newval;
-    Result<uint16_t> result = GetFAT12_entry(*it);
+    FatIterator newval = EndOfChain();
+    Result<uint32_t> result = GetFAT_entry(DirCluster(*it));
     if(result.Ok()){
         newval = result.val;
     };
@@ -127,18 +367,20 @@ Result<none> FAT12::InitRootDir()
     volumelabel.DIR_FileSize = 0x0;
 
     
-    memset(
-        disk + OffsetToFirstCluster(),
+    auto rootoffset = OffsetToCluster(0);
+    if(!rootoffset.Ok())return {rootoffset.status};
+    FillDisk(
+        rootoffset.val,
         0,
-        bpb.BPB_RootEntCnt * sizeof(FileEntry)
+        GetSizeOfCluster(0)
     );
 
 
     memcpy(volumelabel.DIR_Name,bpb.BS_VolLab,sizeof(bpb.BS_VolLab));
 
 
-    memcpy(
-        disk+(bpb.BPB_RsvdSecCnt * bpb.BPB_BytsPerSec) + (bpb.BPB_FATSz16*bpb.BPB_NumFATs*bpb.BPB_BytsPerSec),
+    WriteDisk(
+        rootoffset.val,
         &volumelabel,
         sizeof(volumelabel)
     );
@@ -146,37 +388,180 @@ Result<none> FAT12::InitRootDir()
     return {(int)Fat12Status::OK};
 }
 
-Result<uint16_t> FAT12::GetNextFreeCluster()
+Result<uint32_t> FAT12::GetNextFreeCluster()
+{
+    if(allocationpolicy == AllocationPolicy::WEAR_AWARE){
+        return GetLeastWornFreeCluster();
+    }
+    if(freescancursor >= GetNumberOfValidFatEntries() && freecount == 0){
+        return {(int)Fat12Status::OUT_OF_SPACE};
+    }
+    // No need to have counted free space first: nothing below the hint is
+    // free, so first fit starts there and wraps no further back.
+    size_t start = allocationpolicy == AllocationPolicy::NEXT_FIT ? MAX(nextfitcursor,freehint) : freehint;
+    auto found = FindFatEntry(0,start);
+    if(!found.Ok())return {(int)Fat12Status::ERROR};
+    if(found.val == EndOfChain() && start > freehint){
+        start = freehint;
+        found = FindFatEntry(0,start);
+        if(!found.Ok())return {(int)Fat12Status::ERROR};
+    }
+    if(found.val == EndOfChain())return {(int)Fat12Status::OUT_OF_SPACE};
+    nextfitcursor = found.val + 1;
+    if(start == freehint)freehint = found.val;
+    return {(int)Fat12Status::OK,found.val};
+}
+
+// The free cluster whose erase block has been flushed the fewest times,
+// ties going to the lowest cluster. The block found is then filled until
+// it is full or flushed, so the pass over the FAT runs once per erase
+// block and not once per cluster.
+Result<uint32_t> FAT12::GetLeastWornFreeCluster()
 {
-    for(uint16_t i =0; i < GetNumberOfValidFatEntries(); i++){
-        auto fat12entry = GetFAT12_entry(i);
-        if(fat12entry.Ok()){
-            if(fat12entry.val == 0){
-                PRINT_i(GetFAT12_entry(i));
-                PRINT_i(i);
-                return {(int)Fat12Status::OK,i};
+    uint32_t block[FAT_DECODE_BLOCK];
+    size_t imax = GetNumberOfValidFatEntries();
+    // The cursor is left on the cluster handed out, as the caller may not
+    // take it; the next call moves past it once it is in use.
+    for(uint32_t c = wearcursor; c != 0 && c < imax; c++){
+        auto offset = OffsetToCluster(c);
+        if(!offset.Ok() || offset.val/eraseblocksize != wearblock)break;
+        auto entry = GetFAT_entry(c);
+        if(!entry.Ok())return {entry.status};
+        if(entry.val == 0){
+            wearcursor = c;
+            return {(int)Fat12Status::OK,c};
+        }
+    }
+    wearcursor = 0;
+
+    uint32_t best = 0;
+    uint32_t bestcount = UINT32_MAX;
+    for(size_t i = 2; i < imax && bestcount != 0; i += FAT_DECODE_BLOCK){
+        size_t n = MIN((size_t)FAT_DECODE_BLOCK,imax-i);
+        if(!DecodeFatEntries(i,block,n).Ok())return {(int)Fat12Status::ERROR};
+        for(size_t j = 0; j < n; j++){
+            if(block[j] != 0)continue;
+            auto offset = OffsetToCluster(i+j);
+            if(!offset.Ok())return {offset.status};
+            size_t eraseblock = offset.val/eraseblocksize;
+            uint32_t count = eraseblock < wearcountblocks ? wearcounts[eraseblock] : 0;
+            if(count < bestcount){
+                best = i+j;
+                bestcount = count;
+                if(count == 0)break;
             }
         }
     }
-    return {(int)Fat12Status::OUT_OF_SPACE};
+    if(best == 0)return {(int)Fat12Status::OUT_OF_SPACE};
+    auto offset = OffsetToCluster(best);
+    if(!offset.Ok())return {offset.status};
+    wearblock = offset.val/eraseblocksize;
+    wearcursor = best;
+    return {(int)Fat12Status::OK,best};
+}
+
+// WEAR_AWARE needs dirty tracking and one counter per erase block of the
+// image. The counters count the times Flush handed the block out, which
+// stands in for erases: a device that rewrites a block on every flush
+// erases it about that often, one with its own FTL may not. The counters are only kept
+// in the caller's array; store it next to the image (or in reserved
+// sectors) and pass it back after a reboot to keep the history.
+Result<none> FAT12::SetAllocationPolicyUntraced(AllocationPolicy policy, uint32_t *wearcounts, size_t wearcountblocks)
+{
+    if(policy == AllocationPolicy::WEAR_AWARE){
+        if(!wearcounts)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+        if(!dirtymap)return {(int)Fat12Status::ERROR};
+        if(wearcountblocks < (disk_size + eraseblocksize - 1)/eraseblocksize)return {(int)Fat12Status::OUT_OF_SPACE};
+    }
+    allocationpolicy = policy;
+    this->wearcounts = wearcounts;
+    this->wearcountblocks = wearcounts ? wearcountblocks : 0;
+    nextfitcursor = 2;
+    wearcursor = 0;
+    return {(int)Fat12Status::OK};
+}
+
+void FAT12::SetDiscardCallback(DiscardCallback callback, void *context)
+{
+    discardcallback = callback;
+    discardcontext = context;
+}
+
+// Frees every cluster of the chain starting at first and releases them in
+// contiguous runs.
+Result<none> FAT12::FreeClusterChain(uint32_t first)
+{
+    uint32_t runstart = 0;
+    uint32_t runlength = 0;
+    size_t guard = GetNumberOfValidFatEntries();
+    for(uint32_t cluster = first; cluster >= 2 && FatIteratorOK(cluster) && guard > 0; guard--){
+        auto next = GetFAT_entry(cluster);
+        if(!next.Ok())return {next.status};
+        SetFAT_entry(cluster,0);
+        if(runlength > 0 && cluster == runstart + runlength){
+            runlength++;
+        }else{
+            auto released = ReleaseClusterRun(runstart,runlength);
+            if(!released.Ok())return released;
+            runstart = cluster;
+            runlength = 1;
+        }
+        cluster = next.val;
+    }
+    return ReleaseClusterRun(runstart,runlength);
+}
+
+// Cuts the chain at first after keep clusters (at least one) and frees
+// the rest.
+Result<none> FAT12::TrimChain(uint32_t first, uint32_t keep)
+{
+    uint32_t cluster = first;
+    for(uint32_t i = 1; i < keep; i++){
+        IterateFat(&cluster);
+        if(!FatIteratorOK(cluster))return {(int)Fat12Status::OK};
+    }
+    auto next = GetFAT_entry(cluster);
+    if(!next.Ok())return {next.status};
+    if(IsEndOfChain(next.val))return {(int)Fat12Status::OK};
+    SetFAT_entry(cluster,EndOfChain());
+    return FreeClusterChain(next.val);
+}
+
+Result<none> FAT12::ReleaseClusterRun(uint32_t first, uint32_t count)
+{
+    if(count == 0)return {(int)Fat12Status::OK};
+    auto offset = OffsetToCluster(first);
+    if(!offset.Ok())return {offset.status};
+    size_t length = (size_t)count * GetAllocationUnitSize();
+    if(!discardcallback){
+        FillDisk(offset.val,0,length);
+        return {(int)Fat12Status::OK};
+    }
+    // Nothing in a discarded run needs to reach the backing store anymore.
+    if(dirtymap){
+        ClearDirty(offset.val/DIRTY_SECTOR_SIZE,length/DIRTY_SECTOR_SIZE);
+    }
+    if(discardcallback(discardcontext,offset.val,length) != 0){
+        return {(int)Fat12Status::ERROR};
+    }
+    return {(int)Fat12Status::OK};
 }
 
-Result<none> FAT12::ClearCluster(uint16_t index)
+Result<none> FAT12::ClearCluster(uint32_t index)
 {
     auto offsettocluster_res = OffsetToCluster(index);
     if(!offsettocluster_res.Ok()){
         return {(int)Fat12Status::INDEX_OUT_OF_RANGE};
     }
-    memset(disk + offsettocluster_res.val,0,bpb.BPB_BytsPerSec*bpb.BPB_SecPerClus);
+    FillDisk(offsettocluster_res.val,0,bpb.BPB_BytsPerSec*bpb.BPB_SecPerClus);
     return {(int)Fat12Status::OK};
 }
 
-Result<size_t> FAT12::OffsetToCluster(uint16_t index)
+Result<size_t> FAT12::OffsetToCluster(uint32_t index)
 {   
-    size_t RootDirSectors = (bpb.BPB_RootEntCnt*sizeof(FileEntry) / bpb.BPB_BytsPerSec);
-    size_t RootDirOffset = bpb.BPB_RsvdSecCnt + (bpb.BPB_NumFATs * bpb.BPB_FATSz16);
-    size_t FirstDataSector = RootDirOffset + RootDirSectors;
-    size_t FirstSectorofCluster = ((index - 2) * bpb.BPB_SecPerClus) + FirstDataSector;
+    index = DirCluster(index);
+    size_t RootDirOffset = bpb.BPB_RsvdSecCnt + (bpb.BPB_NumFATs * FatSectors());
+    size_t FirstSectorofCluster = ((size_t)(index - 2) * bpb.BPB_SecPerClus) + FirstDataSector();
 
     size_t offset = FirstSectorofCluster * bpb.BPB_BytsPerSec;
 
@@ -207,11 +592,11 @@ Result<FileHandle> FAT12::GetNextEntryInDir(FileHandle fh)
     fh.dirindex +=1;
     if( fh.dirindex >= entriesincluster){
         fh.dirindex = 0;
-        auto next_entry = GetFAT12_entry(fh.direntry);
+        auto next_entry = GetFAT_entry(DirCluster(fh.direntry));
         if(!next_entry.Ok()){
             return {(int)Fat12Status::ERROR};
         }
-        if(next_entry.val >= 0xff8)return {(int)Fat12Status::ERROR};
+        if(!FatIteratorOK(next_entry.val))return {(int)Fat12Status::ERROR};
         fh.direntry = next_entry.val;
     }
     return {(int)Fat12Status::OK,fh};
@@ -223,7 +608,7 @@ Result<FileHandle> FAT12::GetPreviousEntryInDir(FileHandle fh)
         fh.dirindex -=1;
     }else{
         fh.dirindex = 0;
-        auto next_entry = GetFAT12_reverse_entry(fh.direntry);
+        auto next_entry = GetFAT_reverse_entry(DirCluster(fh.direntry));
         if(!next_entry.Ok()){
             return {(int)Fat12Status::ERROR};
         }
@@ -238,43 +623,272 @@ Result<FileHandle> FAT12::GetPreviousEntryInDir(FileHandle fh)
 
 bool FAT12::IsFAT12(const BPB *bpb)
 {
+    auto type = DetermineFatType(bpb,nullptr);
+    return type.Ok() && type.val == FatType::FAT12;
+}
+
+// The FAT type is decided by the count of clusters alone, as in the spec.
+// bpb32 may be null for volumes that carry 16-bit sizes.
+Result<FatType> FAT12::DetermineFatType(const BPB *bpb, const BPB_FAT32 *bpb32)
+{
+    if(bpb->BPB_BytsPerSec == 0 || bpb->BPB_SecPerClus == 0)return {(int)Fat12Status::ERROR};
     size_t RootDirSectors = ((bpb->BPB_RootEntCnt * 32) + (bpb->BPB_BytsPerSec - 1)) / bpb->BPB_BytsPerSec;
 
     size_t FATSz;
     if(bpb->BPB_FATSz16 != 0){
         FATSz = bpb->BPB_FATSz16;
+    }else if(bpb32){
+        FATSz = bpb32->BPB_FATSz32;
     }else{
-        return false;
-        //FATSz = BPB_FATSz32;
+        return {(int)Fat12Status::ERROR};
     }
     
     size_t TotSec;
     if(bpb->BPB_TotSec16 != 0){
         TotSec = bpb->BPB_TotSec16;
     }else{
-        return false;
-        //TotSec = BPB_TotSec32;
+        TotSec = bpb->BPB_TotSec32;
     }
 
-    size_t DataSec = TotSec - (bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * FATSz) + RootDirSectors);
+    size_t MetaSec = bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * FATSz) + RootDirSectors;
+    if(TotSec <= MetaSec)return {(int)Fat12Status::ERROR};
+    size_t DataSec = TotSec - MetaSec;
 
     size_t CountofClusters = DataSec / bpb->BPB_SecPerClus; 
 
     if(CountofClusters < 4085) {
-        return true; // FAT12
+        return {(int)Fat12Status::OK,FatType::FAT12};
     } else if(CountofClusters < 65525) {
-        /* Volume is FAT16 */
-        return false;
-    } else {
-        /* Volume is FAT32 */
-        return false;
-    } 
-    return false;
+        return {(int)Fat12Status::OK,FatType::FAT16};
+    }
+    if(bpb->BPB_FATSz16 != 0 || bpb->BPB_RootEntCnt != 0){
+        return {(int)Fat12Status::ERROR};
+    }
+    return {(int)Fat12Status::OK,FatType::FAT32};
 }
 
 FAT12::FAT12(uint8_t *disk, size_t disk_size):disk(disk),disk_size(disk_size)
 {
-    
+    memset(&bpb,0,sizeof(bpb));
+    memset(&bpb32,0,sizeof(bpb32));
+    memset(openfiles,0,sizeof(openfiles));
+    fattype = FatType::FAT12;
+    dirtymap = nullptr;
+    eraseblocksize = DIRTY_SECTOR_SIZE;
+    allocationpolicy = AllocationPolicy::FIRST_FIT;
+    ResetAllocationState();
+    wearcounts = nullptr;
+    wearcountblocks = 0;
+    discardcallback = nullptr;
+    discardcontext = nullptr;
+    prefetchcallback = nullptr;
+    prefetchcontext = nullptr;
+    defragcursor = 0;
+    readonly = false;
+    pathindex = nullptr;
+    pathindexcapacity = pathindexcount = 0;
+    pathpool = nullptr;
+    pathpoolcapacity = pathpoolsize = 0;
+    pathindexready = false;
+    tracecallback = nullptr;
+    traceclock = nullptr;
+    tracecontext = nullptr;
+    tracedepth = 0;
+    lastfileid = 0;
+}
+
+void FAT12::WriteDisk(size_t offset, const void *src, size_t length)
+{
+    memcpy(disk + offset,src,length);
+    MarkDirty(offset,length);
+}
+
+void FAT12::FillDisk(size_t offset, uint8_t value, size_t length)
+{
+    memset(disk + offset,value,length);
+    MarkDirty(offset,length);
+}
+
+void FAT12::MarkDirty(size_t offset, size_t length)
+{
+    if(!dirtymap || length == 0)return;
+    size_t last = (offset + length - 1)/DIRTY_SECTOR_SIZE;
+    for(size_t s = offset/DIRTY_SECTOR_SIZE; s <= last; s++){
+        dirtymap[s/32] |= 1u << (s%32);
+    }
+}
+
+bool FAT12::RangeDirty(size_t firstsector, size_t sectors) const
+{
+    for(size_t s = firstsector; s < firstsector + sectors; s++){
+        if(s%32 == 0 && s + 32 <= firstsector + sectors){
+            if(dirtymap[s/32])return true;
+            s += 31;
+            continue;
+        }
+        if(dirtymap[s/32] & (1u << (s%32)))return true;
+    }
+    return false;
+}
+
+void FAT12::ClearDirty(size_t firstsector, size_t sectors)
+{
+    for(size_t s = firstsector; s < firstsector + sectors; s++){
+        dirtymap[s/32] &= ~(1u << (s%32));
+    }
+}
+
+// bitmap needs one bit per DIRTY_SECTOR_SIZE bytes of disk. eraseblocksize
+// is the unit Flush rounds ranges out to, e.g. 4096 for RP2040 flash.
+Result<none> FAT12::EnableDirtyTrackingUntraced(uint32_t *bitmap, size_t bitmapwords, size_t eraseblocksize)
+{
+    if(!bitmap)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    size_t sectors = (disk_size + DIRTY_SECTOR_SIZE - 1)/DIRTY_SECTOR_SIZE;
+    if(bitmapwords*32 < sectors)return {(int)Fat12Status::OUT_OF_SPACE};
+    if(eraseblocksize == 0 || eraseblocksize % DIRTY_SECTOR_SIZE != 0)return {(int)Fat12Status::ERROR};
+    memset(bitmap,0,bitmapwords*sizeof(uint32_t));
+    dirtymap = bitmap;
+    this->eraseblocksize = eraseblocksize;
+    wearcursor = 0;
+    return {(int)Fat12Status::OK};
+}
+
+// Hands every dirty erase block to callback, merging neighbouring blocks
+// into one range, and clears the ranges the callback accepted.
+Result<none> FAT12::FlushUntraced(FlushCallback callback, void *context)
+{
+    return FlushRange(0,disk_size,callback,context);
+}
+
+// Flush restricted to the erase blocks overlapping [offset, offset+length).
+Result<none> FAT12::FlushRangeUntraced(size_t offset, size_t length, FlushCallback callback, void *context)
+{
+    if(!callback)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    if(!dirtymap || length == 0)return {(int)Fat12Status::OK};
+    size_t sectorsperblock = eraseblocksize/DIRTY_SECTOR_SIZE;
+    size_t sectors = (disk_size + DIRTY_SECTOR_SIZE - 1)/DIRTY_SECTOR_SIZE;
+    size_t endblock = (MIN(offset + length,disk_size) + eraseblocksize - 1)/eraseblocksize;
+    bool failed = false;
+    for(size_t block = offset/eraseblocksize; block < endblock && block*sectorsperblock < sectors; ){
+        size_t first = block;
+        while(block < endblock && block*sectorsperblock < sectors && RangeDirty(block*sectorsperblock,MIN(sectorsperblock,sectors - block*sectorsperblock))){
+            block++;
+        }
+        if(block == first){
+            block++;
+            continue;
+        }
+        size_t rangeoffset = first*eraseblocksize;
+        size_t rangelength = MIN((block - first)*eraseblocksize,disk_size - rangeoffset);
+        if(callback(context,rangeoffset,disk + rangeoffset,rangelength) != 0){
+            failed = true;
+            continue;
+        }
+        ClearDirty(first*sectorsperblock,MIN((block - first)*sectorsperblock,sectors - first*sectorsperblock));
+        for(size_t b = first; wearcounts && b < block && b < wearcountblocks; b++){
+            wearcounts[b]++;
+            if(b == wearblock)wearcursor = 0;
+        }
+    }
+    if(failed)return {(int)Fat12Status::ERROR};
+    return {(int)Fat12Status::OK};
+}
+
+OpenFile *FAT12::FindOpenFile(FileHandle filehandle)
+{
+    for(size_t i = 0; i < FAT12_MAX_OPEN_FILES; i++){
+        OpenFile* of = &openfiles[i];
+        if(of->refcount > 0 && of->handle.direntry == filehandle.direntry && of->handle.dirindex == filehandle.dirindex){
+            return of;
+        }
+    }
+    return nullptr;
+}
+
+// Returns the slot already caching filehandle, or loads the entry into a free one.
+// known supplies the directory entry instead of reading it from the disk.
+Result<OpenFile *> FAT12::AcquireOpenFile(FileHandle filehandle, const FileEntry *known)
+{
+    OpenFile* of = FindOpenFile(filehandle);
+    if(of){
+        if(of->refcount == UINT8_MAX)return {(int)Fat12Status::TOO_MANY_OPEN_FILES};
+        of->refcount++;
+        return {(int)Fat12Status::OK,of};
+    }
+    for(size_t i = 0; i < FAT12_MAX_OPEN_FILES; i++){
+        of = &openfiles[i];
+        if(of->refcount != 0)continue;
+        memset(of,0,sizeof(OpenFile));
+        if(known){
+            of->entry = *known;
+        }else if(!GetFileEntryFromHanlde(filehandle,&of->entry).Ok()){
+            return {(int)Fat12Status::ERROR};
+        }
+        of->handle = filehandle;
+        of->refcount = 1;
+        of->dirty = false;
+        return {(int)Fat12Status::OK,of};
+    }
+    return {(int)Fat12Status::TOO_MANY_OPEN_FILES};
+}
+
+Result<OpenFile *> FAT12::GetOpenFile(const FileIOHandle &file)
+{
+    if(file.slot >= FAT12_MAX_OPEN_FILES)return {(int)Fat12Status::INDEX_OUT_OF_RANGE};
+    OpenFile* of = &openfiles[file.slot];
+    if(of->refcount == 0 || of->handle.direntry != file.handle.direntry || of->handle.dirindex != file.handle.dirindex){
+        return {(int)Fat12Status::ERROR};
+    }
+    return {(int)Fat12Status::OK,of};
+}
+
+Result<none> FAT12::WriteBackOpenFile(OpenFile *openfile)
+{
+    if(!openfile->dirty)return {(int)Fat12Status::OK};
+    auto offset = OffsetToFileHandle(openfile->handle);
+    if(!offset.Ok())return {offset.status};
+    WriteDisk(offset.val,&openfile->entry,sizeof(FileEntry));
+    openfile->dirty = false;
+    return {(int)Fat12Status::OK};
+}
+
+// Writes the buffered bytes at the position they were taken from. When file
+// is the handle that filled the buffer, its cluster position follows along.
+Result<none> FAT12::CommitWriteBuffer(OpenFile *openfile, FileIOHandle *file)
+{
+    if(openfile->writebufferfill == 0)return {(int)Fat12Status::OK};
+    FileIOHandle pending;
+    pending.handle = openfile->handle;
+    pending.slot = openfile - openfiles;
+    pending.currentoffset = openfile->writebufferstart;
+    pending.currentAU = openfile->writebuffercluster;
+    pending.mode = FILE_IO_WRITE;
+    uint32_t fill = openfile->writebufferfill;
+    openfile->writebufferfill = 0;
+    auto written = WriteThrough(pending,openfile->writebuffer,fill);
+    if(!written.Ok())return {written.status};
+    if(file && file->currentoffset == pending.currentoffset){
+        file->currentAU = pending.currentAU;
+    }
+    return {(int)Fat12Status::OK};
+}
+
+// buffersize must be a multiple of the sector size and divide the cluster
+// size, e.g. one sector or one cluster. Passing a null buffer turns
+// coalescing off again. The buffer must stay valid until Close.
+Result<none> FAT12::SetWriteBufferUntraced(FileIOHandle &file, uint8_t *buffer, size_t buffersize)
+{
+    auto openfile = GetOpenFile(file);
+    if(!openfile.Ok())return {openfile.status};
+    OpenFile* of = openfile.val;
+    if(buffer && (buffersize == 0 || buffersize % bpb.BPB_BytsPerSec != 0 || GetAllocationUnitSize() % buffersize != 0)){
+        return {(int)Fat12Status::ERROR};
+    }
+    auto commit = CommitWriteBuffer(of,&file);
+    if(!commit.Ok())return commit;
+    of->writebuffer = buffer;
+    of->writebuffersize = buffer ? buffersize : 0;
+    return {(int)Fat12Status::OK};
 }
 
 Result<FileEntry *> FAT12::GetFileEntryFromHanlde(FileHandle filehandle, FileEntry *fileentryout)
@@ -288,17 +902,17 @@ Result<FileEntry *> FAT12::GetFileEntryFromHanlde(FileHandle filehandle, FileEnt
 
 bool FAT12::FatIteratorOK(FatIterator it)
 {
-    return it < 0xff8;
+    return !IsEndOfChain(it);
 }
 
 bool FAT12::DirIsDotOrDotDot(FileEntry *fileentry)
 {   
-    char dot[13] = {'.',0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20};
-    if(memcmp(dot,fileentry->DIR_Name,13) == 0){
+    char dot[SHORTNAME_LEN] = {'.',0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20};
+    if(memcmp(dot,fileentry->DIR_Name,SHORTNAME_LEN) == 0){
         return true;
     }
     dot[1] = '.';
-    if(memcmp(dot,fileentry->DIR_Name,13) == 0){
+    if(memcmp(dot,fileentry->DIR_Name,SHORTNAME_LEN) == 0){
         return true;
     }
     return false;
@@ -306,6 +920,7 @@ bool FAT12::DirIsDotOrDotDot(FileEntry *fileentry)
 
 Result<none> FAT12::CreateLongFileNameEntry(const char *name, size_t len, Directory dir, FileHandle *filehandle)
 {
+    if(readonly)return {(int)Fat12Status::READ_ONLY};
     size_t number_of_longname_entries = (len - 1)/13 + 1;
     
     FileHandle first,last;
@@ -319,16 +934,25 @@ Result<none> FAT12::CreateLongFileNameEntry(const char *name, size_t len, Direct
     //memcpy(fileentry.DIR_Name,,11);
     auto newcluster_res = GetNextFreeCluster();
     if(!newcluster_res.Ok())return {(int)Fat12Status::ERROR};
-    uint16_t newcluster = newcluster_res.val;
-    fileentry.DIR_FstClusLO = newcluster;
-    SetFAT12_entry(newcluster,END_OF_FILE);
+    uint32_t newcluster = newcluster_res.val;
+    fileentry.SetFirstCluster(newcluster);
+    SetFAT_entry(newcluster,EndOfChain());
 
     fileentry.DIR_Attr=ATTR_ARCHIVE;
-    
+
+    return WriteLongFileNameEntryAt(name,len,&fileentry,first,filehandle);
+}
+
+// Writes the long-name slots for name starting at first, followed by entry,
+// whose DIR_Name must already hold the short name. The slots have to exist
+// already; *filehandle gets the short entry.
+Result<none> FAT12::WriteLongFileNameEntryAt(const char *name, size_t len, const FileEntry *entry, FileHandle first, FileHandle *filehandle)
+{
+    size_t number_of_longname_entries = (len - 1)/13 + 1;
 
     LongNameEntry longnamebuf;
     longnamebuf.LDIR_Attr= ATTR_LONG_NAME;
-    longnamebuf.LDIR_Chksum = LongNameChecksum(fileentry.DIR_Name);
+    longnamebuf.LDIR_Chksum = LongNameChecksum(entry->DIR_Name);
     longnamebuf.LDIR_FstClusLO = 0;
     longnamebuf.LDIR_Type = 0;
     longnamebuf.LDIR_ord = LAST_LONG_ENTRY | number_of_longname_entries;
@@ -340,8 +964,7 @@ Result<none> FAT12::CreateLongFileNameEntry(const char *name, size_t len, Direct
         memset(longnamebuf.LDIR_Name1,0,10);
         memset(longnamebuf.LDIR_Name2,0,12);
         memset(longnamebuf.LDIR_Name3,0,4);
-        ol = len - (len%13) - (i*13);
-        printf("OL: %u\n",ol);
+        ol = (number_of_longname_entries - 1 - i)*13; // slots run from the last piece of the name to the first
         for(uint8_t j = 0; j < 5; j++){
             if(ol<len){
                 longnamebuf.LDIR_Name1[j*2] = *(name+ol);
@@ -372,22 +995,22 @@ Result<none> FAT12::CreateLongFileNameEntry(const char *name, size_t len, Direct
 
         auto offset_to_dl = OffsetToFileHandle(cur);
         if(!offset_to_dl.Ok())return {(int)Fat12Status::ERROR};
-        memcpy(disk+offset_to_dl.val,&longnamebuf,sizeof(longnamebuf));
+        WriteDisk(offset_to_dl.val,&longnamebuf,sizeof(longnamebuf));
 
         longnamebuf.LDIR_ord = number_of_longname_entries -1 -i;
 
         cur.dirindex += 1;
         if(cur.dirindex == GetNumberOfFileEntriesPerCluster(cur.direntry)){
-            auto nextentry_res = GetFAT12_entry(cur.direntry);
+            auto nextentry_res = GetFAT_entry(DirCluster(cur.direntry));
             if(!nextentry_res.Ok())return {(int)Fat12Status::ERROR};
             cur.direntry = nextentry_res.val;
             cur.dirindex = 0;
         }
     }
-    auto offset_to_ffe = OffsetToFileHandle(last);
+    auto offset_to_ffe = OffsetToFileHandle(cur);
     if(!offset_to_ffe.Ok())return {(int)Fat12Status::ERROR};
-    memcpy(disk+offset_to_ffe.val,&fileentry,sizeof(fileentry));
-    *filehandle = last;
+    WriteDisk(offset_to_ffe.val,entry,sizeof(FileEntry));
+    *filehandle = cur;
     return {(int)Fat12Status::OK};
 }
 
@@ -396,7 +1019,7 @@ Result<none> FAT12::AllocateMultipleEntriesInDir(Directory dir, size_t count, Fi
     FatIterator lastent;
 
     size_t empty_entries_found = 0;
-    for(FatIterator ent = dir.fat_entry; ent<0xff8; IterateFat(&ent)){
+    for(FatIterator ent = DirCluster(dir.fat_entry); FatIteratorOK(ent); IterateFat(&ent)){
         for(uint16_t i = 0;
         i < GetNumberOfFileEntriesPerCluster(ent);
         i++){
@@ -404,7 +1027,6 @@ Result<none> FAT12::AllocateMultipleEntriesInDir(Directory dir, size_t count, Fi
             auto offset = OffsetToCluster(ent);
             if(!offset.Ok())return {(int)Fat12Status::ERROR};
             memcpy(&fbyte,disk + offset.val + i * sizeof(FileEntry),sizeof(fbyte) );
-            printf("Fbyte: %u\n",fbyte);
 
             if(fbyte ==  0xE5 || fbyte == 0x00){
                 if(empty_entries_found == 0){
@@ -429,8 +1051,9 @@ Result<none> FAT12::AllocateMultipleEntriesInDir(Directory dir, size_t count, Fi
         
         auto newcluster = GetNextFreeCluster();
         if(!newcluster.Ok())return {(int)Fat12Status::ERROR};
-        SetFAT12_entry(lastent,newcluster.val);
-        SetFAT12_entry(newcluster.val,0xfff);
+        SetFAT_entry(lastent,newcluster.val);
+        SetFAT_entry(newcluster.val,EndOfChain());
+        ClearCluster(newcluster.val); // free clusters are not zeroed once discarded
         for(uint16_t j=0; j < GetNumberOfFileEntriesPerCluster(newcluster.val); j++){
             if(empty_entries_found == 0){
                 *first = FileHandle{newcluster.val, j};
@@ -449,17 +1072,17 @@ Result<none> FAT12::AllocateMultipleEntriesInDir(Directory dir, size_t count, Fi
 
 }
 
-Result<FileHandle> FAT12::GetShortNameInDir(Directory dir, const char *shortname, size_t shortname_len)
+Result<FileHandle> FAT12::GetShortNameInDirUntraced(Directory dir, const char *shortname, size_t shortname_len)
 {
     FileHandle fh{dir.fat_entry,0};
     FileEntry fe_buf{0};
     while(true){
         
         if(GetFileEntryFromHanlde(fh,&fe_buf).Ok()){
+            if((uint8_t)fe_buf.DIR_Name[0] == 0x00)break; // end of directory
             if(memcmp(shortname,fe_buf.DIR_Name,MIN(shortname_len,sizeof(fe_buf.DIR_Name)))==0 && fe_buf.DIR_Attr != ATTR_LONG_NAME){
                 return {(int)Fat12Status::OK,fh};
             };
-            printf("1\n");
         }else{
 
             return {(int)Fat12Status::ERROR};
@@ -475,7 +1098,7 @@ Result<FileHandle> FAT12::GetShortNameInDir(Directory dir, const char *shortname
     return {(int)Fat12Status::FILE_DOES_NOT_EXIST};
 }
 
-Result<FileHandle> FAT12::GetLongNameInDir(Directory dir, const char *longname, size_t longname_len)
+Result<FileHandle> FAT12::GetLongNameInDirUntraced(Directory dir, const char *longname, size_t longname_len)
 {
     FileHandle fh {dir.fat_entry,0};
     FileHandle csfh {dir.fat_entry,0};
@@ -485,7 +1108,7 @@ Result<FileHandle> FAT12::GetLongNameInDir(Directory dir, const char *longname,
         {
             GetFileEntryFromHanlde(csfh,(FileEntry*)&lne_buf);
         
-            
+            if(lne_buf.LDIR_ord == 0x00)return {(int)Fat12Status::FILE_DOES_NOT_EXIST}; // end of directory
             if(lne_buf.LDIR_Attr == ATTR_LONG_NAME && (lne_buf.LDIR_ord & 0x40) && lne_buf.LDIR_ord<(0x40<<1)){
                 break;
             }
@@ -504,8 +1127,6 @@ Result<FileHandle> FAT12::GetLongNameInDir(Directory dir, const char *longname,
 
             size_t bigoffsetinname = (lne_count-1)*13;
             
-            uint8_t* bbbbbb = (uint8_t*)&lne_buf;
-            PRINT_buf(bbbbbb,32,16);
             if(longname_len<bigoffsetinname){
                 break;
             }
@@ -519,10 +1140,6 @@ Result<FileHandle> FAT12::GetLongNameInDir(Directory dir, const char *longname,
             memset(n2,0xff,sizeof(n2));
             char n3[4];
             memset(n3,0xff,sizeof(n3));
-            
-            PRINT_buf(n1,10,10);
-            PRINT_buf(n2,12,12);
-            PRINT_buf(n3,4,4);
             for(size_t i = 0; i < 5 && bigoffsetinname+offset_in_block<=longname_len; i++,offset_in_block++){
                 memset(n1+2*i,0,2);
                 if(bigoffsetinname+offset_in_block< longname_len){
@@ -542,10 +1159,6 @@ Result<FileHandle> FAT12::GetLongNameInDir(Directory dir, const char *longname,
                 }
             }
             
-            
-            PRINT_buf(n1,10,10);
-            PRINT_buf(n2,12,12);
-            PRINT_buf(n3,4,4);
 
 
             if(memcmp(n1,lne_buf.LDIR_Name1,sizeof(n1)) == 0 
@@ -577,27 +1190,27 @@ Result<FileHandle> FAT12::GetLongNameInDir(Directory dir, const char *longname,
 
 }
 
+// The attempt-th short name CreateShortNameFromLongName tries for longname.
+void FAT12::ShortNameCandidate(char *shortname_out, const char *longname, size_t longname_len, size_t attempt)
+{
+    memset(shortname_out,0x20,SHORTNAME_LEN);
+    size_t count = MIN(longname_len-attempt,(size_t)SHORTNAME_LEN); // wraps to a full name once attempt passes the length
+    for(unsigned int i = 0; i < count;i++){
+
+        shortname_out[i] = SHORTNAME_LEGAL_CHARACHTERS[(
+            (((uint8_t*)longname)[(i+attempt)%longname_len] + attempt)
+            %
+            (sizeof(SHORTNAME_LEGAL_CHARACHTERS) - 1))]; // never the terminator: a leading 0x00 marks the slot free
+    }
+}
+
 Result<none> FAT12::CreateShortNameFromLongName(char *shortname_out, const char *longname, size_t longname_len, Directory dir)
 {
-    size_t shift = 0;
-    size_t offset = 0;
     if(longname_len == 0)return {(int)Fat12Status::ERROR};
-    while(1){
-        memset(shortname_out,0x20,SHORTNAME_LEN);
-        size_t count = MIN(longname_len-shift,SHORTNAME_LEN);
-        for(unsigned int i = 0; i < count;i++){
-
-            shortname_out[i] = SHORTNAME_LEGAL_CHARACHTERS[(
-                (((uint8_t*)longname)[(i+shift)%longname_len] + offset)
-                %
-                sizeof(SHORTNAME_LEGAL_CHARACHTERS))];
-        }
-    
+    for(size_t attempt = 0; ; attempt++){
+        ShortNameCandidate(shortname_out,longname,longname_len,attempt);
         if(!GetShortNameInDir(dir,shortname_out,11).Ok()){
             break;
-        }else{
-            shift += 1;
-            offset +=1;
         }
     }
     return {(int)Fat12Status::OK};
@@ -619,69 +1232,887 @@ uint8_t FAT12::LongNameChecksum(const char shortname[SHORTNAME_LEN])
 
 }
 
-uint32_t FAT12::GetFreeDiskSpaceAmount()
+// 64 bits, as a FAT32 volume can have more than 4 GiB free.
+uint64_t FAT12::GetFreeDiskSpaceAmountUntraced()
 {   
-    uint32_t freeclusters = 0;
+    return (uint64_t)CountFreeClusters()*GetAllocationUnitSize();
+}
+
+uint32_t FAT12::CountFreeClusters()
+{
+    if(!ScanFreeClusters(SIZE_MAX).Ok())return GetFatStatistics().free;
+    return freecount;
+}
+
+void FAT12::ResetAllocationState()
+{
+    nextfitcursor = 2;
+    wearcursor = 0;
+    wearblock = 0;
+    freehint = 2;
+    freecount = 0;
+    freescancursor = 2;
+}
+
+// Counts the free clusters in the next budget FAT entries, raising the
+// hint over any used run at its front on the way. True once the whole
+// FAT is counted; from then on SetFAT_entry keeps freecount exact.
+Result<bool> FAT12::ScanFreeClusters(size_t budget)
+{
+    uint32_t block[FAT_DECODE_BLOCK];
     size_t imax = GetNumberOfValidFatEntries();
-    for(unsigned i =0; i < imax; i++){
-        auto fatentry_res = GetFAT12_entry(i);
-        
-        if(fatentry_res.Ok() && fatentry_res.val == 0){
-            freeclusters ++;
+    while(budget > 0 && freescancursor < imax){
+        size_t n = MIN(MIN((size_t)FAT_DECODE_BLOCK,imax - freescancursor),budget);
+        if(!DecodeFatEntries(freescancursor,block,n).Ok())return {(int)Fat12Status::ERROR};
+        for(size_t j = 0; j < n; j++){
+            if(block[j] == 0){
+                freecount++;
+            }else if(freehint == freescancursor + j){
+                freehint++;
+            }
         }
+        freescancursor += n;
+        budget -= n;
     }
-    return freeclusters*bpb.BPB_SecPerClus * bpb.BPB_BytsPerSec;
+    return {(int)Fat12Status::OK,freescancursor >= imax};
 }
 
-Result<none> FAT12::AllocateNewEntryInDir(Directory dir, FileHandle *out_entry)
+FatStatistics FAT12::GetFatStatistics()
 {
-    FatIterator lastent;
-    for(FatIterator ent = dir.fat_entry; ent<0xff8; IterateFat(&ent)){
-        printf("ent %u\n",ent);
-        uint8_t fbyte;
-        auto offsettocluster_res = OffsetToCluster(ent);
-        if(offsettocluster_res.Ok()){
-            for(uint16_t i = 0;
-            i < bpb.BPB_SecPerClus*bpb.BPB_BytsPerSec/sizeof(FileEntry);
-            i++){
-                
-                memcpy(&fbyte,disk + offsettocluster_res.val + i * sizeof(FileEntry),sizeof(fbyte) );
-                printf("Fbyte: %u\n",fbyte);
-
-                if(fbyte ==  0xE5 || fbyte == 0x00){
-                    *out_entry = FileHandle{ent, i};
-                    
-                    return {(int)Fat12Status::OK};
-                }
+    FatStatistics stats;
+    memset(&stats,0,sizeof(stats));
+    uint32_t block[FAT_DECODE_BLOCK];
+    uint32_t run = 0;
+    size_t imax = GetNumberOfValidFatEntries();
+    for(size_t i = 2; i < imax; i += FAT_DECODE_BLOCK){
+        size_t n = MIN((size_t)FAT_DECODE_BLOCK,imax-i);
+        if(!DecodeFatEntries(i,block,n).Ok())break;
+        for(size_t j = 0; j < n; j++){
+            uint32_t v = block[j];
+            if(v == 0){
+                stats.free++;
+                if(run == 0)stats.freeruns++;
+                run++;
+                stats.largestfreerun = MAX(stats.largestfreerun,run);
+                continue;
+            }
+            run = 0;
+            if(v == BadCluster()){
+                stats.bad++;
+            }else{
+                stats.used++;
+                if(IsEndOfChain(v))stats.endofchain++;
             }
-        
-            lastent = ent;
         }
     }
-    auto newsector_res = GetNextFreeCluster();
-
-    if(!newsector_res.Ok())return {(int)Fat12Status::ERROR};
-
-    SetFAT12_entry(lastent,newsector_res.val);
-    SetFAT12_entry(newsector_res.val,0xfff);
-    *out_entry = FileHandle{newsector_res.val,0};
-    return {(int)Fat12Status::OK};
-
+    return stats;
 }
 
+bool FAT12::ClaimCluster(FsckContext &ctx, uint32_t cluster)
+{
+    uint32_t bit = 1u << (cluster % 32);
+    uint32_t* word = &ctx.clustermap[cluster / 32];
+#ifdef FAT12_HOST
+    if(ctx.atomic){
+        return __atomic_fetch_or(word,bit,__ATOMIC_RELAXED) & bit;
+    }
+#endif
+    bool claimed = *word & bit;
+    *word |= bit;
+    return claimed;
+}
 
-
-Result<none> FAT12::Format(const char *volumename, BytesPerSector bytespersector, uint8_t SectorPerClusters, bool dual_FATs, size_t SectorsInRootEntry)
+// Claims every cluster of the chain and returns how many it has. A chain
+// running into an owned cluster or an invalid entry is cut off at the last
+// good cluster when repairing; *firstbad says there was none.
+uint32_t FAT12::CheckChain(FsckContext &ctx, uint32_t first, bool *firstbad)
 {
-    bpb = BPB();
-    bpb.BS_jmpBoot[0] = 0xEB;
-    bpb.BS_jmpBoot[1] = 0x00;
+    size_t valid = GetNumberOfValidFatEntries();
+    uint32_t length = 0;
+    uint32_t prev = 0;
+    uint32_t cluster = first;
+    *firstbad = false;
+    while(true){
+        if(cluster < 2 || cluster >= valid || cluster == BadCluster()){
+            ctx.report.badchains++;
+            break;
+        }
+        if(ClaimCluster(ctx,cluster)){
+            ctx.report.crosslinks++;
+            break;
+        }
+        length++;
+        auto next = GetFAT_entry(cluster);
+        if(!next.Ok())return length;
+        if(IsEndOfChain(next.val))return length;
+        if(next.val == 0){
+            ctx.report.badchains++;
+            prev = cluster;
+            break;
+        }
+        prev = cluster;
+        cluster = next.val;
+    }
+    if(prev == 0){
+        *firstbad = true;
+    }else if(ctx.repair){
+        SetFAT_entry(prev,EndOfChain());
+        ctx.report.repaired++;
+    }
+    return length;
+}
+
+void FAT12::CheckDotEntries(FsckContext &ctx, uint32_t cluster, uint32_t parent)
+{
+    const char names[2][SHORTNAME_LEN+1] = {".          ","..         "};
+    uint32_t expected[2] = {cluster,parent};
+    for(uint16_t i = 0; i < 2; i++){
+        FileHandle fh{cluster,i};
+        FileEntry entry;
+        if(!GetFileEntryFromHanlde(fh,&entry).Ok())return;
+        bool named = memcmp(entry.DIR_Name,names[i],SHORTNAME_LEN) == 0;
+        if(named && (entry.DIR_Attr & ATTR_DIRECTORY) && entry.FirstCluster() == expected[i])continue;
+        ctx.report.baddotentries++;
+        // Never overwrite a real entry that happens to sit in the slot.
+        uint8_t fbyte = entry.DIR_Name[0];
+        if(!ctx.repair || !(named || fbyte == 0x00 || fbyte == 0xE5))continue;
+        if(!named){
+            memset(&entry,0,sizeof(entry));
+            memcpy(entry.DIR_Name,names[i],SHORTNAME_LEN);
+        }
+        entry.DIR_Attr = ATTR_DIRECTORY;
+        entry.DIR_FileSize = 0;
+        entry.SetFirstCluster(expected[i]);
+        auto offset = OffsetToFileHandle(fh);
+        if(!offset.Ok())return;
+        WriteDisk(offset.val,&entry,sizeof(entry));
+        ctx.report.repaired++;
+    }
+}
+
+// A file needs ceil(size/cluster) clusters; empty files may keep the one
+// CreateFile gives them. Long chains are cut, short ones shrink the size.
+void FAT12::CheckFileSize(FsckContext &ctx, FileEntry *entry, uint32_t length)
+{
+    size_t au = GetAllocationUnitSize();
+    uint32_t needed = ((size_t)entry->DIR_FileSize + au - 1)/au;
+    if(length == needed || (needed == 0 && length == 1))return;
+    ctx.report.sizemismatches++;
+    if(!ctx.repair)return;
+    if(length > needed){
+        if(!TrimChain(entry->FirstCluster(),MAX(needed,(uint32_t)1)).Ok())return;
+    }else{
+        entry->DIR_FileSize = length * au;
+    }
+    ctx.report.repaired++;
+}
+
+void FAT12::ReleaseOrphanedLongName(FsckContext &ctx, FileHandle first, size_t count)
+{
+    ctx.report.orphanedlongnames++;
+    if(!ctx.repair)return;
+    uint8_t deleted = 0xE5;
+    for(size_t i = 0; i < count; i++){
+        auto offset = OffsetToFileHandle(first);
+        if(!offset.Ok())return;
+        WriteDisk(offset.val,&deleted,sizeof(deleted));
+        auto next = GetNextEntryInDir(first);
+        if(!next.Ok())break;
+        first = next.val;
+    }
+    ctx.report.repaired++;
+}
+
+// Walks one directory, which has already been claimed and is clusters long,
+// and everything below it. A long-name run is only accepted when its
+// ordinals count down to 1 and every checksum matches the short entry
+// that follows it. Trees deeper than FAT12_FSCK_MAX_DEPTH fail with
+// INDEX_OUT_OF_RANGE.
+Result<none> FAT12::CheckDirectory(FsckContext &ctx, uint32_t cluster, uint32_t clusters, unsigned depth)
+{
+    FileHandle fh{cluster,0};
+    size_t entries = clusters * GetNumberOfFileEntriesPerCluster(cluster);
+    FileHandle lfnstart{0,0};
+    size_t lfncount = 0;
+    uint8_t lfnord = 0;
+    uint8_t lfnsum = 0;
+    for(size_t n = 0; n < entries; n++){
+        if(n > 0){
+            auto next = GetNextEntryInDir(fh);
+            if(!next.Ok())break;
+            fh = next.val;
+        }
+        FileEntry entry;
+        if(!GetFileEntryFromHanlde(fh,&entry).Ok())return {(int)Fat12Status::ERROR};
+        uint8_t fbyte = entry.DIR_Name[0];
+        if(fbyte == 0x00)break; // end of directory, anything behind it is free
+        bool unused = fbyte == 0xE5;
+
+        if(!unused && (entry.DIR_Attr & 0x3f) == ATTR_LONG_NAME){
+            const LongNameEntry* lne = (const LongNameEntry*)&entry;
+            if(lne->LDIR_ord & LAST_LONG_ENTRY){
+                if(lfncount)ReleaseOrphanedLongName(ctx,lfnstart,lfncount);
+                lfnstart = fh;
+                lfncount = 1;
+                lfnord = (lne->LDIR_ord & ~LAST_LONG_ENTRY) - 1;
+                lfnsum = lne->LDIR_Chksum;
+            }else if(lfncount && lne->LDIR_ord == lfnord && lne->LDIR_Chksum == lfnsum){
+                lfncount++;
+                lfnord--;
+            }else{
+                if(lfncount)ReleaseOrphanedLongName(ctx,lfnstart,lfncount);
+                ReleaseOrphanedLongName(ctx,fh,1);
+                lfncount = 0;
+            }
+            continue;
+        }
+        if(lfncount && (unused || lfnord != 0 || LongNameChecksum(entry.DIR_Name) != lfnsum)){
+            ReleaseOrphanedLongName(ctx,lfnstart,lfncount);
+        }
+        lfncount = 0;
+        if(unused || (entry.DIR_Attr & ATTR_VOLUME_ID) || fbyte == '.')continue;
+
+        uint32_t firstcluster = entry.FirstCluster();
+        uint32_t length = 0;
+        bool firstbad = false;
+        if(firstcluster != 0){
+            length = CheckChain(ctx,firstcluster,&firstbad);
+        }
+        FileEntry original = entry;
+        if(firstbad && ctx.repair){
+            entry.SetFirstCluster(0);
+            entry.DIR_FileSize = 0;
+            length = 0;
+            ctx.report.repaired++;
+        }
+
+        if(entry.DIR_Attr & ATTR_DIRECTORY){
+            ctx.report.directories++;
+            if(length > 0 && !firstbad){
+                CheckDotEntries(ctx,firstcluster,cluster);
+                if(depth == 0 && ctx.subtrees && ctx.subtreecount < ctx.subtreecapacity){
+                    ctx.subtrees[ctx.subtreecount++] = {firstcluster,length};
+                }else{
+                    if(depth + 1 >= FAT12_FSCK_MAX_DEPTH)return {(int)Fat12Status::INDEX_OUT_OF_RANGE};
+                    auto subtree = CheckDirectory(ctx,firstcluster,length,depth+1);
+                    if(!subtree.Ok())return subtree;
+                }
+            }
+        }else{
+            ctx.report.files++;
+            CheckFileSize(ctx,&entry,length);
+        }
+
+        if(memcmp(&original,&entry,sizeof(entry)) != 0){
+            auto offset = OffsetToFileHandle(fh);
+            if(!offset.Ok())return {offset.status};
+            WriteDisk(offset.val,&entry,sizeof(entry));
+        }
+    }
+    if(lfncount)ReleaseOrphanedLongName(ctx,lfnstart,lfncount);
+    return {(int)Fat12Status::OK};
+}
+
+// The first FAT is taken as the truth, which is also what every lookup uses.
+void FAT12::CheckFatCopies(FsckContext &ctx)
+{
+    size_t sectorsize = bpb.BPB_BytsPerSec;
+    size_t copysize = (size_t)FatSectors() * sectorsize;
+    for(uint8_t copy = 1; copy < bpb.BPB_NumFATs; copy++){
+        for(size_t s = 0; s < copysize; s += sectorsize){
+            const uint8_t* first = disk + OffsetToFat() + s;
+            size_t offset = OffsetToFat() + copy * copysize + s;
+            if(memcmp(first,disk + offset,sectorsize) == 0)continue;
+            ctx.report.fatmismatches++;
+            if(ctx.repair){
+                WriteDisk(offset,first,sectorsize);
+                ctx.report.repaired++;
+            }
+        }
+    }
+}
+
+// Anything allocated that no walk claimed is lost. Repair frees it in runs
+// so the discard callback sees the same ranges FreeClusterChain would give.
+void FAT12::CheckLostClusters(FsckContext &ctx)
+{
+    uint32_t block[FAT_DECODE_BLOCK];
+    size_t imax = GetNumberOfValidFatEntries();
+    uint32_t runstart = 0;
+    uint32_t runlength = 0;
+    for(size_t i = 2; i < imax; i += FAT_DECODE_BLOCK){
+        size_t n = MIN((size_t)FAT_DECODE_BLOCK,imax-i);
+        if(!DecodeFatEntries(i,block,n).Ok())break;
+        for(size_t j = 0; j < n; j++){
+            uint32_t cluster = i+j;
+            if(block[j] == 0 || block[j] == BadCluster())continue;
+            if(ctx.clustermap[cluster/32] & (1u << (cluster%32)))continue;
+            ctx.report.lostclusters++;
+            if(!ctx.repair)continue;
+            SetFAT_entry(cluster,0);
+            if(runlength > 0 && cluster == runstart + runlength){
+                runlength++;
+            }else{
+                ReleaseClusterRun(runstart,runlength);
+                runstart = cluster;
+                runlength = 1;
+                ctx.report.repaired++;
+            }
+        }
+    }
+    ReleaseClusterRun(runstart,runlength);
+}
+
+// Checks the whole volume in one walk over the directory tree followed by
+// one pass over the FAT. clustermap is scratch space of at least one bit
+// per cluster. With threads > 1 on host builds the subtrees below the root
+// are spread over that many threads; repairs always run on one thread, as
+// FAT12 entries share bytes and cannot be written concurrently. A tree too
+// deep to walk fails with INDEX_OUT_OF_RANGE, and with repair set it does
+// so before anything is changed: everything below the limit would
+// otherwise be freed as lost.
+Result<FsckReport> FAT12::CheckUntraced(uint32_t *clustermap, size_t clustermapwords, bool repair, unsigned threads)
+{
+    if(readonly && repair)return {(int)Fat12Status::READ_ONLY};
+    if(!clustermap)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    if(clustermapwords * 32 < GetNumberOfValidFatEntries())return {(int)Fat12Status::OUT_OF_SPACE};
+    if(repair){
+        auto dryrun = CheckUntraced(clustermap,clustermapwords,false,1);
+        if(!dryrun.Ok())return dryrun;
+    }
+    memset(clustermap,0,clustermapwords * sizeof(uint32_t));
+#ifndef FAT12_HOST
+    (void)threads;
+#endif
+
+    FsckContext ctx;
+    memset(&ctx,0,sizeof(ctx));
+    ctx.clustermap = clustermap;
+    ctx.repair = repair;
+
+    CheckFatCopies(ctx);
+
+    uint32_t rootclusters = 1;
+    if(fattype == FatType::FAT32){
+        bool firstbad;
+        rootclusters = CheckChain(ctx,bpb32.BPB_RootClus,&firstbad);
+        if(firstbad)return {(int)Fat12Status::ERROR};
+    }
+
+#ifdef FAT12_HOST
+    std::vector<FsckSubtree> subtrees;
+    if(threads > 1 && !repair){
+        subtrees.resize(rootclusters * GetNumberOfFileEntriesPerCluster(0));
+        ctx.subtrees = subtrees.data();
+        ctx.subtreecapacity = subtrees.size();
+        ctx.atomic = true;
+    }
+#endif
+    auto root = CheckDirectory(ctx,0,rootclusters,0);
+    if(!root.Ok())return {root.status};
+
+#ifdef FAT12_HOST
+    if(ctx.subtreecount > 0){
+        std::atomic<size_t> nexttree{0};
+        std::atomic<int> failed{(int)Fat12Status::OK};
+        std::vector<FsckContext> workers(MIN((size_t)threads,ctx.subtreecount),ctx);
+        std::vector<std::thread> pool;
+        for(FsckContext& worker : workers){
+            memset(&worker.report,0,sizeof(worker.report));
+            worker.subtrees = nullptr;
+            pool.emplace_back([this,&worker,&ctx,&nexttree,&failed](){
+                for(size_t t = nexttree++; t < ctx.subtreecount; t = nexttree++){
+                    auto subtree = CheckDirectory(worker,ctx.subtrees[t].cluster,ctx.subtrees[t].clusters,1);
+                    if(!subtree.Ok())failed = subtree.status;
+                }
+            });
+        }
+        for(std::thread& thread : pool){
+            thread.join();
+        }
+        if(failed != (int)Fat12Status::OK)return {failed};
+        for(const FsckContext& worker : workers){
+            const uint32_t* from = (const uint32_t*)&worker.report;
+            uint32_t* to = (uint32_t*)&ctx.report;
+            for(size_t k = 0; k < sizeof(FsckReport)/sizeof(uint32_t); k++){
+                to[k] += from[k];
+            }
+        }
+    }
+#endif
+
+    CheckLostClusters(ctx);
+    return {(int)Fat12Status::OK,ctx.report};
+}
+
+// Visits every file and directory below cluster, descending into each
+// directory right after visiting it. val is false when the visitor stopped.
+// Trees deeper than FAT12_FSCK_MAX_DEPTH fail with INDEX_OUT_OF_RANGE.
+Result<bool> FAT12::WalkTree(uint32_t cluster, unsigned depth, EntryVisitor visitor, void *context)
+{
+    FileHandle fh{cluster,0};
+    size_t guard = GetNumberOfValidFatEntries() * GetNumberOfFileEntriesPerCluster(cluster);
+    for(bool first = true; guard > 0; guard--, first = false){
+        if(!first){
+            auto next = GetNextEntryInDir(fh);
+            if(!next.Ok())break;
+            fh = next.val;
+        }
+        FileEntry entry;
+        if(!GetFileEntryFromHanlde(fh,&entry).Ok())return {(int)Fat12Status::ERROR};
+        uint8_t fbyte = entry.DIR_Name[0];
+        if(fbyte == 0x00)break; // end of directory
+        if(fbyte == 0xE5 || fbyte == '.')continue;
+        if((entry.DIR_Attr & 0x3f) == ATTR_LONG_NAME || (entry.DIR_Attr & ATTR_VOLUME_ID))continue;
+        if(!visitor(context,fh,&entry))return {(int)Fat12Status::OK,false};
+        if((entry.DIR_Attr & ATTR_DIRECTORY) && entry.FirstCluster() >= 2){
+            if(depth + 1 >= FAT12_FSCK_MAX_DEPTH)return {(int)Fat12Status::INDEX_OUT_OF_RANGE};
+            auto walked = WalkTree(entry.FirstCluster(),depth+1,visitor,context);
+            if(!walked.Ok() || !walked.val)return walked;
+        }
+    }
+    return {(int)Fat12Status::OK,true};
+}
+
+// Number of contiguous pieces of the chain; *clusters gets its length.
+uint32_t FAT12::CountExtents(uint32_t first, uint32_t *clusters)
+{
+    uint32_t extents = 0;
+    uint32_t prev = 0;
+    *clusters = 0;
+    size_t guard = GetNumberOfValidFatEntries();
+    for(FatIterator it = first; it >= 2 && FatIteratorOK(it) && guard > 0; IterateFat(&it), guard--){
+        if(it != prev + 1)extents++;
+        prev = it;
+        (*clusters)++;
+    }
+    return extents;
+}
+
+struct FragmentationWalk{
+    FAT12* fat;
+    FragmentationReport* report;
+};
+
+static bool CountFragmentation(void *context, FileHandle, FileEntry *entry)
+{
+    FragmentationWalk* walk = (FragmentationWalk*)context;
+    FragmentationReport* report = walk->report;
+    if(entry->DIR_Attr & ATTR_DIRECTORY){
+        report->directories++;
+    }else{
+        report->files++;
+    }
+    uint32_t clusters;
+    uint32_t extents = walk->fat->CountExtents(entry->FirstCluster(),&clusters);
+    report->clusters += clusters;
+    report->extents += extents;
+    if(extents > 1)report->fragmentedchains++;
+    report->maxextents = MAX(report->maxextents,extents);
+    return true;
+}
+
+static void AddFreeRun(FragmentationReport *report, uint32_t run)
+{
+    if(run == 0)return;
+    unsigned bucket = 0;
+    while((run >> (bucket + 1)) != 0 && bucket + 1 < FRAGMENTATION_HISTOGRAM_BUCKETS){
+        bucket++;
+    }
+    report->freeruns[bucket]++;
+}
+
+Result<FragmentationReport> FAT12::GetFragmentationReport()
+{
+    FragmentationReport report;
+    memset(&report,0,sizeof(report));
+    if(fattype == FatType::FAT32){
+        uint32_t clusters;
+        report.extents = CountExtents(bpb32.BPB_RootClus,&clusters);
+        report.clusters = clusters;
+        report.maxextents = report.extents;
+        if(report.extents > 1)report.fragmentedchains++;
+    }
+    FragmentationWalk walk{this,&report};
+    auto walked = WalkTree(0,0,CountFragmentation,&walk);
+    if(!walked.Ok())return {walked.status};
+
+    uint32_t block[FAT_DECODE_BLOCK];
+    uint32_t run = 0;
+    size_t imax = GetNumberOfValidFatEntries();
+    for(size_t i = 2; i < imax; i += FAT_DECODE_BLOCK){
+        size_t n = MIN((size_t)FAT_DECODE_BLOCK,imax-i);
+        if(!DecodeFatEntries(i,block,n).Ok())return {(int)Fat12Status::ERROR};
+        for(size_t j = 0; j < n; j++){
+            if(block[j] == 0){
+                run++;
+                continue;
+            }
+            AddFreeRun(&report,run);
+            run = 0;
+        }
+    }
+    AddFreeRun(&report,run);
+    return {(int)Fat12Status::OK,report};
+}
+
+// Directories hold the entries behind every FileHandle, so a directory
+// cluster with an open file in it stays where it is.
+bool FAT12::ChainHasOpenEntries(uint32_t first)
+{
+    for(size_t i = 0; i < FAT12_MAX_OPEN_FILES; i++){
+        if(openfiles[i].refcount == 0)continue;
+        if(first < 2){ // the fixed root
+            if(DirCluster(openfiles[i].handle.direntry) < 2)return true;
+            continue;
+        }
+        size_t guard = GetNumberOfValidFatEntries();
+        for(FatIterator it = first; it >= 2 && FatIteratorOK(it) && guard > 0; IterateFat(&it), guard--){
+            if(DirCluster(openfiles[i].handle.direntry) == it)return true;
+        }
+    }
+    return false;
+}
+
+// Moves count clusters of a chain, starting at first, to the free run at
+// target. The copy and the new links are written (and flushed) before the
+// single pointer to the segment is switched, i.e. the FAT entry of prev
+// or the owner's directory entry when prev is 0, and the old clusters are
+// only freed after that. A crash at any point leaves the chain intact plus
+// at most some lost clusters for Check to collect.
+Result<none> FAT12::RelocateSegment(FileHandle *owner, uint32_t prev, uint32_t first, uint32_t count, uint32_t target, FlushCallback callback, void *context)
+{
+    size_t au = GetAllocationUnitSize();
+    FatIterator it = first;
+    uint32_t last = first;
+    for(uint32_t k = 0; k < count; k++){
+        auto from = OffsetToCluster(it);
+        auto to = OffsetToCluster(target + k);
+        if(!from.Ok() || !to.Ok())return {(int)Fat12Status::ERROR};
+        WriteDisk(to.val,disk + from.val,au);
+        last = it;
+        IterateFat(&it);
+    }
+    for(uint32_t k = 0; k + 1 < count; k++){
+        SetFAT_entry(target + k,target + k + 1);
+    }
+    SetFAT_entry(target + count - 1,it);
+    if(callback){
+        auto to = OffsetToCluster(target);
+        if(!to.Ok())return {to.status};
+        auto flushed = FlushRange(to.val,(size_t)count * au,callback,context);
+        if(!flushed.Ok())return flushed;
+        flushed = FlushFatRange(target,target + count - 1,callback,context);
+        if(!flushed.Ok())return flushed;
+    }
+
+    if(prev != 0){
+        SetFAT_entry(prev,target);
+        if(callback){
+            auto flushed = FlushFatRange(prev,prev,callback,context);
+            if(!flushed.Ok())return flushed;
+        }
+    }else{
+        auto offset = OffsetToFileHandle(*owner);
+        if(!offset.Ok())return {offset.status};
+        FileEntry entry;
+        GetFileEntryFromHanlde(*owner,&entry);
+        entry.SetFirstCluster(target);
+        WriteDisk(offset.val,&entry,sizeof(entry));
+        if(callback){
+            auto flushed = FlushRange(offset.val,sizeof(entry),callback,context);
+            if(!flushed.Ok())return flushed;
+        }
+        if(entry.DIR_Attr & ATTR_DIRECTORY){
+            auto retargeted = RetargetDotEntries(target);
+            if(!retargeted.Ok())return retargeted;
+        }
+    }
+
+    SetFAT_entry(last,EndOfChain());
+    return FreeClusterChain(first);
+}
+
+// Points "." of the directory at cluster, and ".." of every directory in
+// it, back at cluster after the directory has moved. Check repairs these
+// should a crash come in between.
+Result<none> FAT12::RetargetDotEntries(uint32_t cluster)
+{
+    FileEntry entry;
+    FileHandle dot{cluster,0};
+    auto offset = OffsetToFileHandle(dot);
+    if(!offset.Ok() || !GetFileEntryFromHanlde(dot,&entry).Ok())return {(int)Fat12Status::ERROR};
+    if(entry.DIR_Name[0] == '.'){
+        entry.SetFirstCluster(cluster);
+        WriteDisk(offset.val,&entry,sizeof(entry));
+    }
+    FileHandle fh = dot;
+    while(true){
+        if(GetFileEntryFromHanlde(fh,&entry).Ok() && (entry.DIR_Attr & ATTR_DIRECTORY) && (entry.DIR_Attr & 0x3f) != ATTR_LONG_NAME){
+            uint8_t fbyte = entry.DIR_Name[0];
+            if(fbyte != 0x00 && fbyte != 0xE5 && fbyte != '.' && entry.FirstCluster() >= 2){
+                FileHandle dotdot{entry.FirstCluster(),1};
+                FileEntry parent;
+                auto parentoffset = OffsetToFileHandle(dotdot);
+                if(parentoffset.Ok() && GetFileEntryFromHanlde(dotdot,&parent).Ok() && parent.DIR_Name[0] == '.'){
+                    parent.SetFirstCluster(cluster);
+                    WriteDisk(parentoffset.val,&parent,sizeof(parent));
+                }
+            }
+        }
+        auto next = GetNextEntryInDir(fh);
+        if(!next.Ok())break;
+        fh = next.val;
+    }
+    return {(int)Fat12Status::OK};
+}
+
+// One step towards making a chain a single extent, moving at most budget
+// clusters. The first extent is grown into the free clusters behind it;
+// if there are none the whole chain starts over in a free run big enough
+// for all of it. keepfirst pins the first cluster, for the FAT32 root
+// which BPB_RootClus points at.
+Result<uint32_t> FAT12::DefragmentChain(FileHandle *owner, uint32_t first, bool keepfirst, uint32_t budget, FlushCallback callback, void *context)
+{
+    uint32_t total;
+    if(CountExtents(first,&total) <= 1 || budget == 0)return {(int)Fat12Status::OK,0};
+
+    uint32_t extentend = first;
+    uint32_t length = 1;
+    FatIterator it = first;
+    while(IterateFat(&it) == extentend + 1){
+        extentend = it;
+        length++;
+    }
+    uint32_t rest = total - length;
+
+    uint32_t gap = 0;
+    size_t imax = GetNumberOfValidFatEntries();
+    while(gap < rest && extentend + 1 + gap < imax){
+        auto entry = GetFAT_entry(extentend + 1 + gap);
+        if(!entry.Ok() || entry.val != 0)break;
+        gap++;
+    }
+
+    if(gap < rest && !keepfirst){
+        auto run = FindFreeRun(total,2);
+        if(run.Ok()){
+            uint32_t count = MIN(budget,total);
+            auto moved = RelocateSegment(owner,0,first,count,run.val,callback,context);
+            if(!moved.Ok())return {moved.status};
+            return {(int)Fat12Status::OK,count};
+        }
+    }
+    if(gap == 0)return {(int)Fat12Status::OK,0};
+    uint32_t count = MIN(budget,gap);
+    auto moved = RelocateSegment(owner,extentend,it,count,extentend + 1,callback,context);
+    if(!moved.Ok())return {moved.status};
+    return {(int)Fat12Status::OK,count};
+}
+
+struct DefragmentWalk{
+    FAT12* fat;
+    uint32_t index;
+    uint32_t budget;
+    bool directories;
+    FlushCallback callback;
+    void* context;
+    Result<uint32_t> result;
+};
+
+static bool DefragmentEntry(void *context, FileHandle handle, FileEntry *entry)
+{
+    DefragmentWalk* walk = (DefragmentWalk*)context;
+    FAT12* fat = walk->fat;
+    if(walk->index++ < fat->defragcursor)return true;
+    bool directory = entry->DIR_Attr & ATTR_DIRECTORY;
+    if(directory ? !walk->directories || fat->ChainHasOpenEntries(entry->FirstCluster()) : fat->FindOpenFile(handle) != nullptr){
+        fat->defragcursor++;
+        return true;
+    }
+    walk->result = fat->DefragmentChain(&handle,entry->FirstCluster(),false,walk->budget,walk->callback,walk->context);
+    if(!walk->result.Ok() || walk->result.val > 0)return false;
+    fat->defragcursor++;
+    return true;
+}
+
+// Does at most budget cluster moves and returns how many it did; 0 means a
+// whole pass found nothing left to improve. Call it from idle time until
+// it returns 0. Files that are open are skipped. With directories set,
+// directory chains are compacted too, which moves their entries: any
+// FileHandle the caller keeps into a moved directory cluster goes stale.
+// A callback makes every step flush in crash-safe order.
+Result<uint32_t> FAT12::DefragmentUntraced(uint32_t budget, bool directories, FlushCallback callback, void *context)
+{
+    if(readonly)return {(int)Fat12Status::READ_ONLY};
+    if(directories && fattype == FatType::FAT32 && defragcursor == 0){
+        if(!ChainHasOpenEntries(bpb32.BPB_RootClus)){
+            auto moved = DefragmentChain(nullptr,bpb32.BPB_RootClus,true,budget,callback,context);
+            if(!moved.Ok() || moved.val > 0)return moved;
+        }
+    }
+    DefragmentWalk walk{this,0,budget,directories,callback,context,{(int)Fat12Status::OK,0}};
+    auto walked = WalkTree(0,0,DefragmentEntry,&walk);
+    if(!walked.Ok())return {walked.status};
+    if(walked.val)defragcursor = 0;
+    return walk.result;
+}
+
+Result<none> FAT12::AllocateNewEntryInDir(Directory dir, FileHandle *out_entry)
+{
+    if(readonly)return {(int)Fat12Status::READ_ONLY};
+    FatIterator lastent;
+    for(FatIterator ent = DirCluster(dir.fat_entry); FatIteratorOK(ent); IterateFat(&ent)){
+        uint8_t fbyte;
+        auto offsettocluster_res = OffsetToCluster(ent);
+        if(offsettocluster_res.Ok()){
+            for(uint16_t i = 0;
+            i < bpb.BPB_SecPerClus*bpb.BPB_BytsPerSec/sizeof(FileEntry);
+            i++){
+                
+                memcpy(&fbyte,disk + offsettocluster_res.val + i * sizeof(FileEntry),sizeof(fbyte) );
+
+                if(fbyte ==  0xE5 || fbyte == 0x00){
+                    *out_entry = FileHandle{ent, i};
+                    
+                    return {(int)Fat12Status::OK};
+                }
+            }
+        
+            lastent = ent;
+        }
+    }
+    auto newsector_res = GetNextFreeCluster();
+
+    if(!newsector_res.Ok())return {(int)Fat12Status::ERROR};
+
+    SetFAT_entry(lastent,newsector_res.val);
+    SetFAT_entry(newsector_res.val,EndOfChain());
+    ClearCluster(newsector_res.val); // free clusters are not zeroed once discarded
+    *out_entry = FileHandle{newsector_res.val,0};
+    return {(int)Fat12Status::OK};
+
+}
+
+
+
+// Fills in the reserved sectors, sector counts and FAT size for a volume of
+// totalsectors, given bytes per sector, sectors per cluster and number of
+// FATs. Uses the smallest FAT type whose cluster count the finished layout
+// actually falls into, since the FAT size itself eats into the data area.
+// rootentries is ignored for FAT32, whose root is a cluster chain.
+Result<FatType> FAT12::LayoutVolume(BPB *bpb, BPB_FAT32 *bpb32, size_t totalsectors, size_t rootentries)
+{
+    size_t bytespersector = bpb->BPB_BytsPerSec;
+    if(bytespersector == 0 || bpb->BPB_SecPerClus == 0)return {(int)Fat12Status::ERROR};
+    const FatType candidates[3] = {FatType::FAT12,FatType::FAT16,FatType::FAT32};
+    for(FatType type : candidates){
+        bool fat32 = type == FatType::FAT32;
+        bpb->BPB_RsvdSecCnt = fat32 ? 32 : 0x01; // FAT32 keeps FSInfo and a backup boot sector here
+        bpb->BPB_RootEntCnt = fat32 ? 0 : rootentries;
+        size_t rootdirsectors = (bpb->BPB_RootEntCnt*sizeof(FileEntry) + bytespersector - 1)/bytespersector;
+        if(totalsectors <= bpb->BPB_RsvdSecCnt + rootdirsectors)continue;
+
+        size_t entriescount = (totalsectors - bpb->BPB_RsvdSecCnt - rootdirsectors)/bpb->BPB_SecPerClus + 2;
+        size_t fatbytes;
+        switch(type){
+            case FatType::FAT12: fatbytes = (entriescount*3 + 1)/2; break;
+            case FatType::FAT16: fatbytes = entriescount*2; break;
+            default: fatbytes = entriescount*4; break;
+        }
+        size_t sectorsrequiredforFAT = (fatbytes + bytespersector - 1)/bytespersector;
+
+        if(!fat32 && totalsectors < 0x10000){
+            bpb->BPB_TotSec16 = totalsectors;
+            bpb->BPB_TotSec32 = 0;
+        }else{
+            bpb->BPB_TotSec16 = 0;
+            bpb->BPB_TotSec32 = totalsectors;
+        }
+        if(fat32){
+            bpb->BPB_FATSz16 = 0;
+            bpb32->BPB_FATSz32 = sectorsrequiredforFAT;
+        }else{
+            if(sectorsrequiredforFAT > 0xffff)continue;
+            bpb->BPB_FATSz16 = sectorsrequiredforFAT;
+        }
+        auto determined = DetermineFatType(bpb,bpb32);
+        if(determined.Ok() && determined.val == type){
+            return {(int)Fat12Status::OK,type};
+        }
+    }
+    return {(int)Fat12Status::ERROR};
+}
+
+// Tries every cluster size up to 32 KiB and keeps the one wasting the least
+// space for the expected files: the slack in their last clusters plus the
+// FAT copies. Ties go to the larger cluster, which means fewer FAT lookups
+// per byte read. Every file, even an empty one, is charged at least one
+// cluster since CreateFile allocates one. The root directory gets room for
+// a long and a short entry per file, up to 512 entries.
+Result<FormatGeometry> FAT12::PlanGeometry(size_t disk_size, BytesPerSector bytespersector, bool dual_FATs, const uint32_t *filesizes, size_t filecount)
+{
+    if(filecount > 0 && !filesizes)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    size_t totalsectors = disk_size/bytespersector;
+    size_t rootentries = MIN(MAX(filecount*2,(size_t)1),(size_t)512);
+    size_t rootsectors = (rootentries*sizeof(FileEntry) + bytespersector - 1)/bytespersector;
+
+    FormatGeometry best;
+    memset(&best,0,sizeof(best));
+    uint64_t bestcost = UINT64_MAX;
+    for(size_t spc = 1; spc <= 128 && spc*bytespersector <= 32768; spc <<= 1){
+        BPB b;
+        BPB_FAT32 b32;
+        memset(&b,0,sizeof(b));
+        memset(&b32,0,sizeof(b32));
+        b.BPB_BytsPerSec = bytespersector;
+        b.BPB_SecPerClus = spc;
+        b.BPB_NumFATs = dual_FATs ? 2 : 1;
+        auto type = LayoutVolume(&b,&b32,totalsectors,rootsectors*bytespersector/sizeof(FileEntry));
+        if(!type.Ok())continue;
+
+        size_t fatsectors = b.BPB_FATSz16 != 0 ? b.BPB_FATSz16 : b32.BPB_FATSz32;
+        size_t metasectors = b.BPB_RsvdSecCnt + b.BPB_NumFATs*fatsectors + (b.BPB_RootEntCnt*sizeof(FileEntry) + bytespersector - 1)/bytespersector;
+        uint64_t clusters = (totalsectors - metasectors)/spc;
+        uint64_t clustersize = spc*bytespersector;
+        uint64_t slack = 0;
+        uint64_t needed = type.val == FatType::FAT32 ? 1 : 0; // the FAT32 root
+        for(size_t i = 0; i < filecount; i++){
+            uint64_t used = MAX((uint64_t)(filesizes[i] + clustersize - 1)/clustersize,(uint64_t)1);
+            needed += used;
+            slack += used*clustersize - filesizes[i];
+        }
+        if(needed > clusters)continue;
+        uint64_t cost = slack + (uint64_t)b.BPB_NumFATs*fatsectors*bytespersector;
+        if(cost > bestcost)continue;
+        bestcost = cost;
+        best.bytespersector = bytespersector;
+        best.sectorspercluster = spc;
+        best.dualfats = dual_FATs;
+        best.rootsectors = type.val == FatType::FAT32 ? 0 : rootsectors;
+        best.fattype = type.val;
+        best.clusters = clusters;
+        best.fatsectors = fatsectors;
+        best.slack = slack;
+    }
+    if(bestcost == UINT64_MAX)return {(int)Fat12Status::OUT_OF_SPACE};
+    return {(int)Fat12Status::OK,best};
+}
+
+Result<none> FAT12::FormatUntraced(const char *volumename, BytesPerSector bytespersector, uint8_t SectorPerClusters, bool dual_FATs, size_t SectorsInRootEntry, uint8_t flags)
+{
+    if(readonly)return {(int)Fat12Status::READ_ONLY};
+    bpb = BPB();
+    memset(openfiles,0,sizeof(openfiles));
+    bpb.BS_jmpBoot[0] = 0xEB;
+    bpb.BS_jmpBoot[1] = 0x00;
     bpb.BS_jmpBoot[2] = 0x90;
     char OEMName[9] = "SFAT1.0\0";
     memcpy(bpb.BS_OEMName,OEMName,8);
+    bpb32 = BPB_FAT32();
     bpb.BPB_BytsPerSec = bytespersector;
     bpb.BPB_SecPerClus = SectorPerClusters;
-    bpb.BPB_RsvdSecCnt = 0x01;
+    if(SectorPerClusters == 0)return {(int)Fat12Status::ERROR};
     
     if(dual_FATs){
         bpb.BPB_NumFATs = 2;
@@ -689,26 +2120,18 @@ Result<none> FAT12::Format(const char *volumename, BytesPerSector bytespersector
         bpb.BPB_NumFATs = 1;
     }
 
-    bpb.BPB_RootEntCnt= bytespersector/32; // This might need a change
-    bpb.BPB_TotSec16 = disk_size/bytespersector;
-
     bpb.BPB_Media = 0xF0; // this is also not written in stone
 
-    size_t sectorsavalible = bpb.BPB_TotSec16;
-    sectorsavalible -= 1; // Bootsector
-
-    size_t entriescount = sectorsavalible/SectorPerClusters;
-
-    size_t sectorsrequiredforFAT =   (((1 + entriescount * 3) / 2) / bpb.BPB_BytsPerSec) +1;
-
-
-    bpb.BPB_FATSz16 = sectorsrequiredforFAT;
+    size_t rootentries = MAX(SectorsInRootEntry,(size_t)1)*bytespersector/sizeof(FileEntry);
+    if(rootentries > 0xffff)return {(int)Fat12Status::ERROR};
+    auto layout = LayoutVolume(&bpb,&bpb32,disk_size/bytespersector,rootentries);
+    if(!layout.Ok())return {layout.status};
+    fattype = layout.val;
 
     bpb.BPB_SecPerTrk = 0x01;
     bpb.BPB_NumHeads = 0x01;
     bpb.BPB_HiddSec = 0x00;
 
-    bpb.BPB_TotSec32 = 0x00;
     bpb.BS_DrvNum = 0x80;
     bpb.BS_Reserved1 = 0x00;
 
@@ -716,28 +2139,63 @@ Result<none> FAT12::Format(const char *volumename, BytesPerSector bytespersector
 
     bpb.BS_VolID = 0x00001234;
     memcpy(bpb.BS_VolLab,volumename,MIN(strlen(volumename),11));
-    memcpy(bpb.BS_FilSysType,"FAT12\0\0",8);
-
-    
-    char bootsector_buffer[bpb.BPB_BytsPerSec]={0};
+    switch(fattype){
+        case FatType::FAT12: memcpy(bpb.BS_FilSysType,"FAT12\0\0",8); break;
+        case FatType::FAT16: memcpy(bpb.BS_FilSysType,"FAT16\0\0",8); break;
+        case FatType::FAT32:
+            bpb32.BPB_RootClus = 2;
+            bpb32.BPB_FSInfo = 1;
+            bpb32.BPB_BkBootSec = 6;
+            bpb32.BS_DrvNum = bpb.BS_DrvNum;
+            bpb32.BS_BootSig = bpb.BS_BootSig;
+            bpb32.BS_VolID = bpb.BS_VolID;
+            memcpy(bpb32.BS_VolLab,bpb.BS_VolLab,sizeof(bpb32.BS_VolLab));
+            memcpy(bpb32.BS_FilSysType,"FAT32\0\0",8);
+            break;
+    }
 
-    memcpy(bootsector_buffer,&bpb,sizeof(bpb));
-    
-    memset(disk,0,disk_size);// clears the whole drive
+    // A quick format only clears the metadata and leaves the data area as
+    // it is; nothing reads a cluster before it has been written or cleared.
+    size_t dataoffset = OffsetToFirstCluster();
+    size_t cleared = (flags & FORMAT_QUICK) ? dataoffset : disk_size;
+    memset(disk,0,cleared);
+    MarkDirty(0,cleared);
+    if((flags & FORMAT_DISCARD) && discardcallback && dataoffset < disk_size){
+        if(dirtymap){
+            ClearDirty(dataoffset/DIRTY_SECTOR_SIZE,(disk_size - dataoffset)/DIRTY_SECTOR_SIZE);
+        }
+        if(discardcallback(discardcontext,dataoffset,disk_size - dataoffset) != 0){
+            return {(int)Fat12Status::ERROR};
+        }
+    }
 
     memcpy(disk,&bpb,sizeof(bpb));
 
     uint8_t magic_bytes[2]={0x55,0xAA};
     memcpy(disk+510,magic_bytes,sizeof(magic_bytes));
 
+    if(fattype == FatType::FAT32){
+        memcpy(disk+BPB_FAT32_OFFSET,&bpb32,sizeof(bpb32));
+
+        // FSInfo with "unknown" free count and hint, then the backup boot sector.
+        uint8_t* fsinfo = disk + bpb32.BPB_FSInfo*bytespersector;
+        const uint32_t fsinfo_words[5] = {0x41615252,0x61417272,0xffffffff,0xffffffff,0xaa550000};
+        memcpy(fsinfo,&fsinfo_words[0],4);
+        memcpy(fsinfo+484,&fsinfo_words[1],12);
+        memcpy(fsinfo+508,&fsinfo_words[4],4);
+        memcpy(disk + bpb32.BPB_BkBootSec*bytespersector,disk,bytespersector);
+    }
+
 
+    ResetAllocationState();
     InitFAT();
     InitRootDir();
     return {(int)Fat12Status::OK};
 
 }
-Result<none> FAT12::CreateFile(const char name[8], const char extension[3], Directory parent,FileHandle* filehandle)
+Result<none> FAT12::CreateFileUntraced(const char name[8], const char extension[3], Directory parent,FileHandle* filehandle)
 {
+    if(readonly)return {(int)Fat12Status::READ_ONLY};
     FileEntry file;
     size_t namelen = strnlen(name,8);
     size_t extensionlen = strnlen(extension,3);
@@ -765,14 +2223,14 @@ Result<none> FAT12::CreateFile(const char name[8], const char extension[3], Dire
 
     if(!firstcluster.Ok())return {(int)Fat12Status::ERROR};
 
-    file.DIR_FstClusLO = firstcluster.val;
-    if(!SetFAT12_entry(firstcluster.val,END_OF_FILE).Ok())return {(int)Fat12Status::ERROR};
+    file.SetFirstCluster(firstcluster.val);
+    if(!SetFAT_entry(firstcluster.val,EndOfChain()).Ok())return {(int)Fat12Status::ERROR};
     
 
     auto offsettofilehandle_res = OffsetToFileHandle(newfilehandle);
     if(!offsettofilehandle_res.Ok()) return {(int)Fat12Status::ERROR};
 
-    memcpy(disk +offsettofilehandle_res.val
+    WriteDisk(offsettofilehandle_res.val
         ,
         &file,
         sizeof(file)
@@ -780,12 +2238,14 @@ Result<none> FAT12::CreateFile(const char name[8], const char extension[3], Dire
     *filehandle = newfilehandle;
     return {(int)Fat12Status::OK};
 }
-Result<none> FAT12::DeleteFile(FileHandle filehandle)
+Result<none> FAT12::DeleteFileUntraced(FileHandle filehandle)
 {
+    if(readonly)return {(int)Fat12Status::READ_ONLY};
     
     FileEntry fentry;
     bool haslongname = false;
 
+    if(FindOpenFile(filehandle))return {(int)Fat12Status::FILE_IS_OPEN};
     if(!GetFileEntryFromHanlde(filehandle,&fentry).Ok())return {(int)Fat12Status::ERROR};
 
     uint8_t lname_chk;
@@ -865,18 +2325,19 @@ Result<none> FAT12::DeleteFile(FileHandle filehandle)
 
 
     if(fentry.DIR_Attr & ATTR_DIRECTORY){
-        auto empty = DirectoryEmpty({fentry.DIR_FstClusLO});
+        auto empty = DirectoryEmpty({fentry.FirstCluster()});
         if(!(empty.Ok() && empty.val)){
             return {(int)Fat12Status::DIRECTORY_NOT_EMPTY};
         }
     };
     bool finished = false;
     while(!finished){
-        finished = memcmp(&lastfh, &ffilehandle,sizeof(FileHandle)) == 0;
+        finished = lastfh.direntry == ffilehandle.direntry && lastfh.dirindex == ffilehandle.dirindex;
 
         auto offset = OffsetToFileHandle(lastfh);
         if(!offset.Ok()){return {(int)Fat12Status::ERROR};}
-        memset(disk + offset.val,0xE5,sizeof(FileEntry)); // this might need some change too!
+        FillDisk(offset.val,0xE5,sizeof(FileEntry)); // this might need some change too!
+        if(finished)break; // the short entry may be the directory's last slot
         auto next = GetNextEntryInDir(lastfh);
         if(!next.Ok()){return {(int)Fat12Status::ERROR};}
         lastfh = next.val;
@@ -886,94 +2347,756 @@ Result<none> FAT12::DeleteFile(FileHandle filehandle)
 
 
 
-    uint16_t fat = fentry.DIR_FstClusLO;
-    
-    while(fat > 0 && fat < 0xff8){
-        auto nextfat = GetFAT12_entry(fat);
-        if(nextfat.Ok()){
-            SetFAT12_entry(fat,0);
-            auto offsettocluster = OffsetToCluster(fat);
-            if(!offsettocluster.Ok())return {(int)Fat12Status::ERROR};
+    if(!FreeClusterChain(fentry.FirstCluster()).Ok())return {(int)Fat12Status::ERROR};
+   
+    return {(int)Fat12Status::OK};
+}
 
-            memset(disk + offsettocluster.val,0,bpb.BPB_BytsPerSec*bpb.BPB_SecPerClus);
-            fat = nextfat.val;
+// First slot of the long-name run in front of the short entry at
+// filehandle, or filehandle itself when there is no complete run.
+Result<FileHandle> FAT12::FindLongNameStart(FileHandle filehandle)
+{
+    FileEntry entry;
+    if(!GetFileEntryFromHanlde(filehandle,&entry).Ok())return {(int)Fat12Status::ERROR};
+    uint8_t checksum = LongNameChecksum(entry.DIR_Name);
+    FileHandle cur = filehandle;
+    for(uint8_t ord = 1; ord <= 20; ord++){
+        // The fixed root has no previous cluster to step back into.
+        if(cur.dirindex == 0 && DirCluster(cur.direntry) < 2)break;
+        auto prev = GetPreviousEntryInDir(cur);
+        if(!prev.Ok())break;
+        LongNameEntry lne;
+        if(!GetFileEntryFromHanlde(prev.val,(FileEntry*)&lne).Ok())break;
+        if(lne.LDIR_Attr != ATTR_LONG_NAME || lne.LDIR_Chksum != checksum || (lne.LDIR_ord & ~LAST_LONG_ENTRY) != ord)break;
+        cur = prev.val;
+        if(lne.LDIR_ord & LAST_LONG_ENTRY){
+            return {(int)Fat12Status::OK,cur};
         }
     }
-   
+    return {(int)Fat12Status::OK,filehandle};
+}
+
+// True when dir is ancestor or the directory at cluster itself, found by
+// following ".." entries up to the root.
+Result<bool> FAT12::DirectoryIsWithin(Directory dir, uint32_t ancestor)
+{
+    uint32_t cluster = dir.fat_entry;
+    if(fattype == FatType::FAT32 && cluster == bpb32.BPB_RootClus){
+        cluster = 0;
+    }
+    for(unsigned depth = 0; cluster != 0 && depth < FAT12_FSCK_MAX_DEPTH; depth++){
+        if(cluster == ancestor)return {(int)Fat12Status::OK,true};
+        FileEntry dotdot;
+        if(!GetFileEntryFromHanlde(FileHandle{cluster,1},&dotdot).Ok())return {(int)Fat12Status::ERROR};
+        if(dotdot.DIR_Name[0] != '.' || dotdot.DIR_Name[1] != '.')return {(int)Fat12Status::ERROR};
+        cluster = dotdot.FirstCluster();
+    }
+    return {(int)Fat12Status::OK,cluster == ancestor};
+}
+
+// Moves the entry at filehandle into newparent under a new long name. Only
+// directory slots are written: the new entry goes in first and the old
+// slots are freed after, so a crash leaves the file reachable. A moved
+// directory gets its ".." pointed at newparent.
+Result<none> FAT12::RenameUntraced(FileHandle filehandle, Directory newparent, const char *name, size_t len, FileHandle *out)
+{
+    if(readonly)return {(int)Fat12Status::READ_ONLY};
+    if(!name || !out)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    if(len == 0 || len > 255)return {(int)Fat12Status::ERROR};
+    if(FindOpenFile(filehandle))return {(int)Fat12Status::FILE_IS_OPEN};
+
+    FileEntry entry;
+    if(!GetFileEntryFromHanlde(filehandle,&entry).Ok())return {(int)Fat12Status::ERROR};
+    uint8_t fbyte = entry.DIR_Name[0];
+    if(fbyte == 0x00 || fbyte == 0xE5 || fbyte == '.')return {(int)Fat12Status::FILE_DOES_NOT_EXIST};
+    if((entry.DIR_Attr & 0x3f) == ATTR_LONG_NAME || (entry.DIR_Attr & ATTR_VOLUME_ID))return {(int)Fat12Status::ERROR};
+
+    bool directory = entry.DIR_Attr & ATTR_DIRECTORY;
+    if(directory){
+        auto within = DirectoryIsWithin(newparent,entry.FirstCluster());
+        if(!within.Ok())return {within.status};
+        if(within.val)return {(int)Fat12Status::ERROR};
+    }
+    if(GetLongNameInDir(newparent,name,len).Ok())return {(int)Fat12Status::FILE_ALREADY_EXISTS};
+
+    auto start = FindLongNameStart(filehandle);
+    if(!start.Ok())return {start.status};
+
+    FileEntry moved = entry;
+    auto shortname = CreateShortNameFromLongName(moved.DIR_Name,name,len,newparent);
+    if(!shortname.Ok())return shortname;
+    size_t slots = (len - 1)/13 + 2;
+    FileHandle first,last;
+    if(!AllocateMultipleEntriesInDir(newparent,slots,&first,&last).Ok())return {(int)Fat12Status::OUT_OF_SPACE};
+    auto written = WriteLongFileNameEntryAt(name,len,&moved,first,out);
+    if(!written.Ok())return written;
+
+    uint8_t deleted = 0xE5;
+    for(FileHandle fh = start.val; ; ){
+        auto offset = OffsetToFileHandle(fh);
+        if(!offset.Ok())return {offset.status};
+        WriteDisk(offset.val,&deleted,sizeof(deleted));
+        if(fh.direntry == filehandle.direntry && fh.dirindex == filehandle.dirindex)break;
+        auto next = GetNextEntryInDir(fh);
+        if(!next.Ok())return {(int)Fat12Status::ERROR};
+        fh = next.val;
+    }
+
+    if(directory){
+        // ".." of a directory in the root always points at cluster 0, even on FAT32.
+        uint32_t parentcluster = newparent.fat_entry;
+        if(fattype == FatType::FAT32 && parentcluster == bpb32.BPB_RootClus){
+            parentcluster = 0;
+        }
+        FileHandle dotdot{entry.FirstCluster(),1};
+        FileEntry dotdotentry;
+        auto offset = OffsetToFileHandle(dotdot);
+        if(!offset.Ok() || !GetFileEntryFromHanlde(dotdot,&dotdotentry).Ok())return {(int)Fat12Status::ERROR};
+        dotdotentry.SetFirstCluster(parentcluster);
+        WriteDisk(offset.val,&dotdotentry,sizeof(dotdotentry));
+    }
     return {(int)Fat12Status::OK};
 }
 
-Result<none> FAT12::ClearContentsOfFile(FileHandle filehandle)
+// Duplicates a file into dstdir under a long name. The copy gets one
+// contiguous extent when the volume has one, and data moves a whole run
+// at a time, as long as source and destination both stay contiguous.
+// Clusters are claimed and filled before the entry is written, so a
+// crash leaves lost clusters at worst.
+Result<none> FAT12::CopyFileUntraced(FileHandle src, Directory dstdir, const char *name, size_t len, FileHandle *out)
+{
+    if(readonly)return {(int)Fat12Status::READ_ONLY};
+    if(!name || !out)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    if(len == 0 || len > 255)return {(int)Fat12Status::ERROR};
+
+    FileEntry entry;
+    OpenFile* openfile = FindOpenFile(src);
+    if(openfile){
+        auto commit = CommitWriteBuffer(openfile,nullptr);
+        if(!commit.Ok())return commit;
+        entry = openfile->entry;
+    }else if(!GetFileEntryFromHanlde(src,&entry).Ok()){
+        return {(int)Fat12Status::ERROR};
+    }
+    if(entry.DIR_Attr & (ATTR_DIRECTORY | ATTR_VOLUME_ID))return {(int)Fat12Status::ERROR};
+    if(GetLongNameInDir(dstdir,name,len).Ok())return {(int)Fat12Status::FILE_ALREADY_EXISTS};
+
+    size_t au = GetAllocationUnitSize();
+    uint32_t dataclusters = ((size_t)entry.DIR_FileSize + au - 1)/au;
+    uint32_t clusters = MAX(dataclusters,(uint32_t)1); // CreateFile gives empty files a cluster too
+
+    uint32_t dstfirst = 0;
+    auto run = FindFreeRun(clusters,2);
+    if(run.Ok()){
+        dstfirst = run.val;
+        for(uint32_t k = 0; k + 1 < clusters; k++){
+            SetFAT_entry(dstfirst + k,dstfirst + k + 1);
+        }
+        SetFAT_entry(dstfirst + clusters - 1,EndOfChain());
+    }else{
+        if(CountFreeClusters() < clusters)return {(int)Fat12Status::OUT_OF_SPACE};
+        uint32_t prev = 0;
+        size_t cursor = 2;
+        for(uint32_t k = 0; k < clusters; k++){
+            auto found = FindFatEntry(0,cursor);
+            if(!found.Ok() || found.val == EndOfChain()){
+                if(dstfirst)FreeClusterChain(dstfirst);
+                return {(int)Fat12Status::OUT_OF_SPACE};
+            }
+            SetFAT_entry(found.val,EndOfChain());
+            if(prev){
+                SetFAT_entry(prev,found.val);
+            }else{
+                dstfirst = found.val;
+            }
+            prev = found.val;
+            cursor = found.val + 1;
+        }
+    }
+
+    FatIterator s = entry.FirstCluster();
+    FatIterator t = dstfirst;
+    for(uint32_t copied = 0; copied < dataclusters; ){
+        if(s < 2 || !FatIteratorOK(s)){
+            FreeClusterChain(dstfirst);
+            return {(int)Fat12Status::ERROR};
+        }
+        uint32_t sstart = s;
+        uint32_t tstart = t;
+        uint32_t n = 0;
+        do{
+            n++;
+            uint32_t sprev = s;
+            uint32_t tprev = t;
+            IterateFat(&s);
+            IterateFat(&t);
+            if(s != sprev + 1 || t != tprev + 1)break;
+        }while(copied + n < dataclusters);
+        auto from = OffsetToCluster(sstart);
+        auto to = OffsetToCluster(tstart);
+        if(!from.Ok() || !to.Ok()){
+            FreeClusterChain(dstfirst);
+            return {(int)Fat12Status::ERROR};
+        }
+        WriteDisk(to.val,disk + from.val,MIN((size_t)n*au,(size_t)entry.DIR_FileSize - (size_t)copied*au));
+        copied += n;
+    }
+
+    FileEntry copy = entry;
+    copy.SetFirstCluster(dstfirst);
+    auto shortname = CreateShortNameFromLongName(copy.DIR_Name,name,len,dstdir);
+    if(!shortname.Ok()){
+        FreeClusterChain(dstfirst);
+        return shortname;
+    }
+    FileHandle first,last;
+    if(!AllocateMultipleEntriesInDir(dstdir,(len - 1)/13 + 2,&first,&last).Ok()){
+        FreeClusterChain(dstfirst);
+        return {(int)Fat12Status::OUT_OF_SPACE};
+    }
+    return WriteLongFileNameEntryAt(name,len,&copy,first,out);
+}
+
+struct TreeRemoval{
+    FAT12* fat;
+    FsckContext* ctx;
+    int status;
+};
+
+static bool CollectTreeEntry(void *context, FileHandle handle, FileEntry *entry)
+{
+    TreeRemoval* removal = (TreeRemoval*)context;
+    FAT12* fat = removal->fat;
+    bool directory = entry->DIR_Attr & ATTR_DIRECTORY;
+    if(directory ? fat->ChainHasOpenEntries(entry->FirstCluster()) : fat->FindOpenFile(handle) != nullptr){
+        removal->status = (int)Fat12Status::FILE_IS_OPEN;
+        return false;
+    }
+    if(entry->FirstCluster() != 0){
+        bool firstbad;
+        fat->CheckChain(*removal->ctx,entry->FirstCluster(),&firstbad);
+    }
+    return true;
+}
+
+// Frees every cluster set in clustermap, lowest first. Neighbouring
+// clusters go out as one run even when they belonged to different chains.
+Result<none> FAT12::ReleaseClusterMap(const uint32_t *clustermap, size_t clustermapwords)
+{
+    uint32_t runstart = 0;
+    uint32_t runlength = 0;
+    size_t imax = GetNumberOfValidFatEntries();
+    for(size_t w = 0; w < clustermapwords && w*32 < imax; w++){
+        for(uint32_t bits = clustermap[w]; bits != 0; bits &= bits - 1){
+            uint32_t cluster = w*32 + __builtin_ctz(bits);
+            SetFAT_entry(cluster,0);
+            if(runlength > 0 && cluster == runstart + runlength){
+                runlength++;
+                continue;
+            }
+            auto released = ReleaseClusterRun(runstart,runlength);
+            if(!released.Ok())return released;
+            runstart = cluster;
+            runlength = 1;
+        }
+    }
+    return ReleaseClusterRun(runstart,runlength);
+}
+
+// Deletes the entry at filehandle and, for a directory, everything below
+// it. A depth-first walk first claims every chain in clustermap (scratch
+// space of one bit per cluster) and checks that nothing in the tree is
+// open or cross-linked; nothing is written before that. Then only the
+// top entry's slots are marked deleted, since the directories below go
+// away whole, and all collected clusters are freed in one pass.
+Result<none> FAT12::RemoveTreeUntraced(FileHandle filehandle, uint32_t *clustermap, size_t clustermapwords)
+{
+    if(readonly)return {(int)Fat12Status::READ_ONLY};
+    if(!clustermap)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    if(clustermapwords * 32 < GetNumberOfValidFatEntries())return {(int)Fat12Status::OUT_OF_SPACE};
+    memset(clustermap,0,clustermapwords * sizeof(uint32_t));
+
+    FileEntry entry;
+    if(!GetFileEntryFromHanlde(filehandle,&entry).Ok())return {(int)Fat12Status::ERROR};
+    uint8_t fbyte = entry.DIR_Name[0];
+    if(fbyte == 0x00 || fbyte == 0xE5 || fbyte == '.')return {(int)Fat12Status::FILE_DOES_NOT_EXIST};
+    if((entry.DIR_Attr & 0x3f) == ATTR_LONG_NAME || (entry.DIR_Attr & ATTR_VOLUME_ID))return {(int)Fat12Status::ERROR};
+
+    FsckContext ctx;
+    memset(&ctx,0,sizeof(ctx));
+    ctx.clustermap = clustermap;
+    TreeRemoval removal{this,&ctx,(int)Fat12Status::OK};
+    if(!CollectTreeEntry(&removal,filehandle,&entry))return {removal.status};
+    if((entry.DIR_Attr & ATTR_DIRECTORY) && entry.FirstCluster() >= 2){
+        auto walked = WalkTree(entry.FirstCluster(),1,CollectTreeEntry,&removal);
+        if(!walked.Ok())return {walked.status};
+        if(!walked.val)return {removal.status};
+    }
+    if(ctx.report.crosslinks > 0)return {(int)Fat12Status::ERROR};
+
+    auto start = FindLongNameStart(filehandle);
+    if(!start.Ok())return {start.status};
+    uint8_t deleted = 0xE5;
+    for(FileHandle fh = start.val; ; ){
+        auto offset = OffsetToFileHandle(fh);
+        if(!offset.Ok())return {offset.status};
+        WriteDisk(offset.val,&deleted,sizeof(deleted));
+        if(fh.direntry == filehandle.direntry && fh.dirindex == filehandle.dirindex)break;
+        auto next = GetNextEntryInDir(fh);
+        if(!next.Ok())return {(int)Fat12Status::ERROR};
+        fh = next.val;
+    }
+    return ReleaseClusterMap(clustermap,clustermapwords);
+}
+
+static uint32_t ShortNameHash(const char *shortname)
+{
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < SHORTNAME_LEN; i++){
+        hash = (hash ^ (uint8_t)shortname[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void BloomAdd(uint32_t *bloom, uint32_t hash)
+{
+    uint32_t a = hash % FAT12_BATCH_BLOOM_BITS;
+    uint32_t b = (hash >> 16 | hash << 16) % FAT12_BATCH_BLOOM_BITS;
+    bloom[a/32] |= 1u << (a%32);
+    bloom[b/32] |= 1u << (b%32);
+}
+
+static bool BloomMayContain(const uint32_t *bloom, uint32_t hash)
+{
+    uint32_t a = hash % FAT12_BATCH_BLOOM_BITS;
+    uint32_t b = (hash >> 16 | hash << 16) % FAT12_BATCH_BLOOM_BITS;
+    return (bloom[a/32] & (1u << (a%32))) && (bloom[b/32] & (1u << (b%32)));
+}
+
+// Walks the directory once, handing out runs of free slots in order. Used
+// short names are added to bloom on the way.
+bool FAT12::NextFreeSlots(SlotScanner &scanner, size_t slots, uint32_t *bloom, FileHandle *first)
+{
+    while(!scanner.atend){
+        FileEntry entry;
+        if(!GetFileEntryFromHanlde(scanner.pos,&entry).Ok()){
+            scanner.atend = true;
+            break;
+        }
+        uint8_t fbyte = entry.DIR_Name[0];
+        FileHandle here = scanner.pos;
+        auto next = GetNextEntryInDir(scanner.pos);
+        if(next.Ok()){
+            scanner.pos = next.val;
+        }else{
+            scanner.atend = true;
+            scanner.last = DirCluster(here.direntry);
+        }
+        if(fbyte == 0x00 || fbyte == 0xE5){
+            if(scanner.runlength == 0)scanner.runstart = here;
+            scanner.runlength++;
+            if(scanner.runlength == slots){
+                *first = scanner.runstart;
+                scanner.runlength = 0;
+                return true;
+            }
+            continue;
+        }
+        scanner.runlength = 0;
+        if((entry.DIR_Attr & 0x3f) != ATTR_LONG_NAME){
+            BloomAdd(bloom,ShortNameHash(entry.DIR_Name));
+        }
+    }
+    return false;
+}
+
+// The index-th cluster of a batch: from the free run at runstart, or first
+// fit after *cursor when there was no run big enough. Returned as an
+// end of chain.
+Result<uint32_t> FAT12::TakeBatchCluster(uint32_t runstart, uint32_t index, uint32_t *cursor)
+{
+    uint32_t cluster = runstart + index;
+    if(runstart == 0){
+        auto found = FindFatEntry(0,*cursor);
+        if(!found.Ok() || found.val == EndOfChain())return {(int)Fat12Status::OUT_OF_SPACE};
+        cluster = found.val;
+        *cursor = cluster + 1;
+    }
+    SetFAT_entry(cluster,EndOfChain());
+    return {(int)Fat12Status::OK,cluster};
+}
+
+// Creates count files with long names in dir, like CreateLongFileNameEntry
+// per name but with one scan for free slots and existing short names, one
+// allocation of the directory's new clusters plus every file's first
+// cluster (contiguous when possible) and entries written in slot order.
+// Short names are screened against a bloom filter of the names in the
+// directory instead of a lookup per candidate. val is the number of files created; out
+// gets their handles. Fewer than count means the directory (a fixed root)
+// or the volume ran out of space.
+Result<size_t> FAT12::CreateFilesUntraced(Directory dir, const char *const *names, const size_t *lens, size_t count, FileHandle *out)
+{
+    if(readonly)return {(int)Fat12Status::READ_ONLY};
+    if(!names || !lens || !out)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    for(size_t i = 0; i < count; i++){
+        if(!names[i] || lens[i] == 0 || lens[i] > 255)return {(int)Fat12Status::ERROR};
+    }
+
+    uint32_t bloom[FAT12_BATCH_BLOOM_BITS/32];
+    memset(bloom,0,sizeof(bloom));
+    SlotScanner scanner;
+    memset(&scanner,0,sizeof(scanner));
+    scanner.pos = FileHandle{dir.fat_entry,0};
+
+    size_t placed = 0;
+    while(placed < count && NextFreeSlots(scanner,(lens[placed] - 1)/13 + 2,bloom,&out[placed])){
+        placed++;
+    }
+    if(placed == count){
+        // The rest of the directory still has short names to collide with.
+        FileHandle unused;
+        NextFreeSlots(scanner,SIZE_MAX,bloom,&unused);
+    }
+
+    // Whatever did not fit goes into new clusters behind the directory,
+    // continuing the free run it ended with. The fixed root cannot grow.
+    size_t percluster = GetAllocationUnitSize()/sizeof(FileEntry);
+    uint32_t extension = 0;
+    if(placed < count && DirCluster(dir.fat_entry) >= 2){
+        size_t slots = 0;
+        for(size_t i = placed; i < count; i++){
+            slots += (lens[i] - 1)/13 + 2;
+        }
+        slots -= MIN(slots,scanner.runlength);
+        extension = (slots + percluster - 1)/percluster;
+    }
+    uint32_t files = extension > 0 ? count : placed;
+    uint32_t clusters = extension + files;
+
+    // Directory extension first, then one first cluster per file.
+    uint32_t cursor = 2;
+    uint32_t runstart = 0;
+    auto run = FindFreeRun(MAX(clusters,(uint32_t)1),2);
+    if(run.Ok()){
+        runstart = run.val;
+    }else if(clusters > CountFreeClusters()){
+        return {(int)Fat12Status::OUT_OF_SPACE};
+    }
+    uint32_t previous = scanner.last;
+    for(uint32_t k = 0; k < extension; k++){
+        auto cluster = TakeBatchCluster(runstart,k,&cursor);
+        if(!cluster.Ok())return {cluster.status};
+        ClearCluster(cluster.val); // free clusters are not zeroed once discarded
+        SetFAT_entry(previous,cluster.val);
+        previous = cluster.val;
+    }
+    if(extension > 0){
+        scanner.atend = false;
+        auto next = GetNextEntryInDir(scanner.pos);
+        if(!next.Ok())return {(int)Fat12Status::ERROR};
+        scanner.pos = next.val;
+        while(placed < count && NextFreeSlots(scanner,(lens[placed] - 1)/13 + 2,bloom,&out[placed])){
+            placed++;
+        }
+    }
+
+    for(size_t i = 0; i < placed; i++){
+        FileEntry entry;
+        memset(&entry,0,sizeof(entry));
+        for(size_t attempt = 0; ; attempt++){
+            ShortNameCandidate(entry.DIR_Name,names[i],lens[i],attempt);
+            uint32_t hash = ShortNameHash(entry.DIR_Name);
+            // A positive is usually a name this batch already took; just
+            // move on, and only ask the directory once the filter is this full.
+            if(BloomMayContain(bloom,hash) && (attempt < FAT12_BATCH_BLOOM_ATTEMPTS || GetShortNameInDir(dir,entry.DIR_Name,SHORTNAME_LEN).Ok()))continue;
+            BloomAdd(bloom,hash);
+            break;
+        }
+        auto cluster = TakeBatchCluster(runstart,extension + i,&cursor);
+        if(!cluster.Ok())return {cluster.status,i};
+        entry.SetFirstCluster(cluster.val);
+        entry.DIR_Attr = ATTR_ARCHIVE;
+        auto written = WriteLongFileNameEntryAt(names[i],lens[i],&entry,out[i],&out[i]);
+        if(!written.Ok())return {written.status,i};
+    }
+    if(placed < count)return {(int)Fat12Status::OUT_OF_SPACE,placed};
+    return {(int)Fat12Status::OK,placed};
+}
+
+// Links clusters onto the file until its chain covers bytes, without
+// touching DIR_FileSize or the clusters' contents, so later writes only
+// follow existing links. The clusters go right behind the chain when there
+// is room, else into as few runs as the free space allows. The file must
+// be open, as opening for writing truncates and only the last Close gives
+// back whatever was not written; a file that is not open fails with ERROR.
+Result<none> FAT12::PreallocateUntraced(FileHandle filehandle, size_t bytes)
 {
+    if(readonly)return {(int)Fat12Status::READ_ONLY};
+    if(bytes > UINT32_MAX)return {(int)Fat12Status::OUT_OF_SPACE};
+    FileEntry entry;
+    if(!GetFileEntryFromHanlde(filehandle,&entry).Ok())return {(int)Fat12Status::ERROR};
+    if(entry.DIR_Attr & ATTR_DIRECTORY)return {(int)Fat12Status::ERROR};
+    OpenFile* of = FindOpenFile(filehandle);
+    if(!of)return {(int)Fat12Status::ERROR};
+    uint32_t last = of->entry.FirstCluster();
+    if(last < 2)return {(int)Fat12Status::ERROR};
+
+    size_t au = GetAllocationUnitSize();
+    uint32_t target = (bytes + au - 1)/au;
+    uint32_t chainlength = 1;
+    for(size_t guard = GetNumberOfValidFatEntries(); guard > 0; guard--){
+        auto next = GetFAT_entry(last);
+        if(!next.Ok())return {next.status};
+        if(IsEndOfChain(next.val))break;
+        last = next.val;
+        chainlength++;
+    }
+    if(chainlength >= target)return {(int)Fat12Status::OK};
+    uint32_t needed = target - chainlength;
+    if(needed > CountFreeClusters())return {(int)Fat12Status::OUT_OF_SPACE};
+
+    while(needed > 0){
+        uint32_t length = needed;
+        auto run = FindFreeRun(needed,last + 1);
+        if(!run.Ok())run = FindFreeRun(needed,2);
+        if(!run.Ok())run = LargestFreeRun(&length);
+        if(!run.Ok())return {(int)Fat12Status::OUT_OF_SPACE};
+        length = MIN(length,needed);
+        // Link the run first and hook it on last, so the chain never
+        // points into a half-built run.
+        for(uint32_t k = 0; k + 1 < length; k++){
+            SetFAT_entry(run.val + k,run.val + k + 1);
+        }
+        SetFAT_entry(run.val + length - 1,EndOfChain());
+        SetFAT_entry(last,run.val);
+        last = run.val + length - 1;
+        needed -= length;
+    }
+    of->preallocated = true;
+    return {(int)Fat12Status::OK};
+}
+
+Result<none> FAT12::ClearContentsOfFileUntraced(FileHandle filehandle)
+{
+    if(readonly)return {(int)Fat12Status::READ_ONLY};
     FileEntry fe;
     if(!GetFileEntryFromHanlde(filehandle,&fe).Ok()){
         return {(int)Fat12Status::ERROR};
     }
     fe.DIR_FileSize = 0;
-    size_t fatent= fe.DIR_FstClusLO;
-    size_t nextfatent = 0;
-    while(nextfatent < 0xff8)
-    {
-        HANDLE_ERROR(,nextfatent,GetFAT12_entry(fatent),return {(int)Fat12Status::ERROR};);
-        ClearCluster(fatent);
-        SetFAT12_entry(fatent,0);
+    if(!FreeClusterChain(fe.FirstCluster()).Ok())return {(int)Fat12Status::ERROR};
+    SetFAT_entry(fe.FirstCluster(),EndOfChain());
+    WriteDisk(OffsetToFileHandle(filehandle).val,&fe,sizeof(fe));
+    OpenFile* of = FindOpenFile(filehandle);
+    if(of){
+        of->entry = fe;
+        of->dirty = false;
     }
-    SetFAT12_entry(fe.DIR_FstClusLO,0xfff);
-    memcpy(disk+OffsetToFileHandle(filehandle).val,&fe,sizeof(fe));
     return {(int)Fat12Status::OK};
 }
 
-Result<FileIOHandle> FAT12::Open(FileHandle file, uint8_t mode)
+Result<FileIOHandle> FAT12::OpenUntraced(FileHandle file, uint8_t mode)
 {
+    if(readonly && (mode & FILE_MODE_WRITE))return {(int)Fat12Status::READ_ONLY};
     FileIOHandle fileio;
+    memset(&fileio,0,sizeof(fileio));
     
     fileio.handle = file;
-    FileEntry entry;
-    auto entry_res = GetFileEntryFromHanlde(fileio.handle,&entry);
-    if(!entry_res.Ok()){return {(int)Fat12Status::ERROR};};
-    PRINT_X(mode);
+    auto openfile_res = AcquireOpenFile(file);
+    if(!openfile_res.Ok()){return {openfile_res.status};};
+    OpenFile* openfile = openfile_res.val;
+    FileEntry& entry = openfile->entry;
+    fileio.slot = openfile - openfiles;
+    if(++lastfileid == 0)lastfileid = 1;
+    fileio.id = lastfileid;
     if(mode & FILE_MODE_WRITE){
         fileio.mode = FILE_IO_WRITE;
         if(mode & FILE_MODE_APP){
             panic("file mode append not supported yeet");
         }else{
             fileio.currentoffset = 0;
-            fileio.currentAU = entry.DIR_FstClusLO;
+            fileio.currentAU = entry.FirstCluster();
             entry.DIR_FileSize = 0;
-            FatIterator it = fileio.currentAU;
-            ClearCluster(it);
-            IterateFat(&it);
-            for(;FatIteratorOK(it);){
-                FatIterator Cur = it;
-                ClearCluster(it);
-                IterateFat(&it);
-                SetFAT12_entry(Cur,0x00);
-            }
-
-            SetFAT12_entry(fileio.currentAU,END_OF_FILE);
+            openfile->writebufferfill = 0;
+            openfile->dirty = true;
+            FreeClusterChain(fileio.currentAU);
+            SetFAT_entry(fileio.currentAU,EndOfChain());
         }
        
         
     }else{
         fileio.mode = FILE_IO_READ;
         fileio.currentoffset = 0;
-        fileio.currentAU = entry.DIR_FstClusLO;
+        fileio.currentAU = entry.FirstCluster();
     }
 
     return {(int)Fat12Status::OK,fileio};
 }
 
-Result<none> FAT12::Close(FileIOHandle *file)
+Result<none> FAT12::CloseUntraced(FileIOHandle *file)
 {
+    if(!file)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    auto openfile = GetOpenFile(*file);
+    if(!openfile.Ok())return {openfile.status};
+    auto commit = CommitWriteBuffer(openfile.val,file);
+    auto writeback = WriteBackOpenFile(openfile.val);
+    openfile.val->refcount--;
+    if(openfile.val->refcount == 0){
+        openfile.val->writebuffer = nullptr;
+        openfile.val->writebuffersize = 0;
+        if(openfile.val->preallocated){
+            // Give back what Preallocate reserved but nothing was written to.
+            size_t au = GetAllocationUnitSize();
+            uint32_t keep = ((size_t)openfile.val->entry.DIR_FileSize + au - 1)/au;
+            TrimChain(openfile.val->entry.FirstCluster(),MAX(keep,(uint32_t)1));
+        }
+    }
+    if(!commit.Ok()){
+        memset(file,0,sizeof(FileIOHandle));
+        return commit;
+    }
     memset(file,0,sizeof(FileIOHandle));
+    return {writeback.status};
+}
+
+// Flushes the FAT bytes holding entries first..last in every FAT copy.
+Result<none> FAT12::FlushFatRange(uint32_t first, uint32_t last, FlushCallback callback, void *context)
+{
+    size_t fatbytes = (size_t)FatSectors() * bpb.BPB_BytsPerSec;
+    size_t from,to;
+    if(fattype == FatType::FAT12){
+        from = first*3/2;
+        to = (last*3)/2 + 1;
+    }else{
+        size_t width = fattype == FatType::FAT16 ? 2 : 4;
+        from = first*width;
+        to = last*width + width - 1;
+    }
+    for(size_t i = 0; i < bpb.BPB_NumFATs; i++){
+        auto flushed = FlushRange(OffsetToFat() + i*fatbytes + from,to - from + 1,callback,context);
+        if(!flushed.Ok())return flushed;
+    }
     return {(int)Fat12Status::OK};
 }
 
-Result<size_t> FAT12::Read(FileIOHandle &file, uint8_t *buffer, size_t buffersize)
+// Persists one file: its data clusters first, then the FAT sectors that
+// describe its chain, and only then its directory entry. The cached entry
+// is written into the image after the data is out, so a flushed directory
+// sector never names clusters whose contents were not flushed before it.
+// The order holds per erase block, as Flush hands out whole dirty blocks:
+// when an erase block holds both file data and FAT or directory sectors
+// (small images, or erase blocks wider than a cluster), those sectors go
+// out with the data pass. Entries freed by a truncation lie past the new
+// chain and are left dirty; a crash then leaks those clusters until Check
+// frees them, but never hands them to another file.
+Result<none> FAT12::SyncUntraced(FileIOHandle &file, FlushCallback callback, void *context)
+{
+    if(!callback)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    auto openfile = GetOpenFile(file);
+    if(!openfile.Ok())return {openfile.status};
+    OpenFile* of = openfile.val;
+    auto commit = CommitWriteBuffer(of,&file);
+    if(!commit.Ok())return commit;
+
+    // Pass 0 writes the data of each contiguous run, pass 1 its FAT entries.
+    for(int pass = 0; pass < 2; pass++){
+        uint32_t runstart = of->entry.FirstCluster();
+        while(runstart >= 2 && FatIteratorOK(runstart)){
+            uint32_t runend = runstart;
+            FatIterator it = runstart;
+            while(IterateFat(&it) == runend + 1){
+                runend = it;
+            }
+            if(pass == 0){
+                auto offset = OffsetToCluster(runstart);
+                if(!offset.Ok())return {offset.status};
+                auto flushed = FlushRange(offset.val,(size_t)(runend - runstart + 1)*GetAllocationUnitSize(),callback,context);
+                if(!flushed.Ok())return flushed;
+            }else{
+                auto flushed = FlushFatRange(runstart,runend,callback,context);
+                if(!flushed.Ok())return flushed;
+            }
+            runstart = it;
+        }
+    }
+
+    auto writeback = WriteBackOpenFile(of);
+    if(!writeback.Ok())return writeback;
+    auto entryoffset = OffsetToFileHandle(of->handle);
+    if(!entryoffset.Ok())return {entryoffset.status};
+    return FlushRange(entryoffset.val,sizeof(FileEntry),callback,context);
+}
+
+Result<none> FAT12::FlushUntraced(FileIOHandle &file)
+{
+    auto openfile = GetOpenFile(file);
+    if(!openfile.Ok())return {openfile.status};
+    auto commit = CommitWriteBuffer(openfile.val,&file);
+    if(!commit.Ok())return commit;
+    return WriteBackOpenFile(openfile.val);
+}
+
+void FAT12::SetPrefetchCallback(PrefetchCallback callback, void *context)
+{
+    prefetchcallback = callback;
+    prefetchcontext = context;
+}
+
+// Keeps a window of clusters ahead of a sequential reader in flight. The
+// chain is walked once per top-up and contiguous clusters are prefetched as
+// one range, so cluster boundaries in Read no longer wait on the device.
+void FAT12::ReadAhead(FileIOHandle &file, const FileEntry &entry)
+{
+    if(!prefetchcallback)return;
+    if(file.currentoffset != file.lastreadend){
+        file.sequentialreads = 0;
+        file.readaheadoffset = 0;
+        return;
+    }
+    if(file.sequentialreads < 8){
+        file.sequentialreads++;
+    }
+    size_t au = GetAllocationUnitSize();
+    size_t window = MIN((size_t)1 << file.sequentialreads,(size_t)FAT12_READAHEAD_CLUSTERS) * au;
+    if(file.readaheadoffset <= file.currentoffset || file.readaheadcluster < 2){
+        file.readaheadoffset = file.currentoffset - file.currentoffset % au;
+        file.readaheadcluster = file.currentAU;
+    }
+    if(file.readaheadoffset - file.currentoffset >= window/2)return;
+
+    size_t target = MIN((size_t)file.currentoffset + window,(size_t)entry.DIR_FileSize);
+    uint32_t cluster = file.readaheadcluster;
+    uint32_t runstart = 0;
+    uint32_t runlength = 0;
+    while(file.readaheadoffset < target && cluster >= 2 && FatIteratorOK(cluster)){
+        if(runlength > 0 && cluster == runstart + runlength){
+            runlength++;
+        }else{
+            if(runlength > 0){
+                auto offset = OffsetToCluster(runstart);
+                if(offset.Ok())prefetchcallback(prefetchcontext,offset.val,runlength*au);
+            }
+            runstart = cluster;
+            runlength = 1;
+        }
+        file.readaheadoffset += au;
+        IterateFat(&cluster);
+    }
+    if(runlength > 0){
+        auto offset = OffsetToCluster(runstart);
+        if(offset.Ok())prefetchcallback(prefetchcontext,offset.val,runlength*au);
+    }
+    file.readaheadcluster = cluster;
+}
+
+Result<size_t> FAT12::ReadUntraced(FileIOHandle &file, uint8_t *buffer, size_t buffersize)
 {
     size_t read = 0;
-    FileEntry entry;
-    if(!GetFileEntryFromHanlde(file.handle,&entry).Ok()){return {(int)Fat12Status::ERROR};};
+    auto openfile = GetOpenFile(file);
+    if(!openfile.Ok()){return {(int)Fat12Status::ERROR};};
+    if(!CommitWriteBuffer(openfile.val,nullptr).Ok()){return {(int)Fat12Status::ERROR};};
+    const FileEntry& entry = openfile.val->entry;
+    ReadAhead(file,entry);
 
     //PRINT_i(file.currentAU);
     //PRINT_i(file.currentoffset);
@@ -1002,13 +3125,56 @@ Result<size_t> FAT12::Read(FileIOHandle &file, uint8_t *buffer, size_t buffersiz
             IterateFat(&file.currentAU);
         }
     }
+    file.lastreadend = file.currentoffset;
     return {(int)Fat12Status::OK,read};
 }
 
-Result<size_t> FAT12::Write(FileIOHandle &file,const uint8_t *buffer, size_t buffersize)
+Result<size_t> FAT12::WriteUntraced(FileIOHandle &file,const uint8_t *buffer, size_t buffersize)
 {
-    size_t offset_into_buffer = 0;
     if(!(file.mode & FILE_IO_WRITE)){return {(int)Fat12Status::ERROR};};
+    if(buffersize > UINT32_MAX - file.currentoffset){return {(int)Fat12Status::OUT_OF_SPACE};};
+    auto openfile = GetOpenFile(file);
+    if(!openfile.Ok()){return {(int)Fat12Status::ERROR};};
+    OpenFile* of = openfile.val;
+    if(!of->writebuffer){
+        return WriteThrough(file,buffer,buffersize);
+    }
+
+    // Small writes collect in the buffer until it reaches a buffer-aligned
+    // boundary, so the disk only ever sees whole sectors in steady state.
+    size_t offset_into_buffer = 0;
+    while(offset_into_buffer < buffersize){
+        if(of->writebufferfill > 0 && of->writebufferstart + of->writebufferfill != file.currentoffset){
+            if(!CommitWriteBuffer(of,nullptr).Ok())return {(int)Fat12Status::ERROR};
+        }
+        size_t room = of->writebuffersize - file.currentoffset % of->writebuffersize;
+        size_t chunk = MIN(room,buffersize - offset_into_buffer);
+        if(of->writebufferfill == 0 && chunk == of->writebuffersize){
+            auto written = WriteThrough(file,buffer + offset_into_buffer,chunk);
+            if(!written.Ok())return written;
+            offset_into_buffer += chunk;
+            continue;
+        }
+        if(of->writebufferfill == 0){
+            of->writebufferstart = file.currentoffset;
+            of->writebuffercluster = file.currentAU;
+        }
+        memcpy(of->writebuffer + of->writebufferfill,buffer + offset_into_buffer,chunk);
+        of->writebufferfill += chunk;
+        file.currentoffset += chunk;
+        offset_into_buffer += chunk;
+        if(file.currentoffset % of->writebuffersize == 0){
+            if(!CommitWriteBuffer(of,&file).Ok())return {(int)Fat12Status::ERROR};
+        }
+    }
+    return {(int)Fat12Status::OK,buffersize};
+}
+
+Result<size_t> FAT12::WriteThrough(FileIOHandle &file,const uint8_t *buffer, size_t buffersize)
+{
+    size_t offset_into_buffer = 0;
+    auto openfile = GetOpenFile(file);
+    if(!openfile.Ok()){return {(int)Fat12Status::ERROR};};
 
     while(offset_into_buffer < buffersize){
 
@@ -1024,40 +3190,39 @@ Result<size_t> FAT12::Write(FileIOHandle &file,const uint8_t *buffer, size_t buf
 
         size_t maxwrite = MIN(GetAllocationUnitSize()-offset_in_sector,buffersize-offset_into_buffer);
 
-        memcpy(disk + offset_to_cluster.val+offset_in_sector,buffer+offset_into_buffer,maxwrite);
+        WriteDisk(offset_to_cluster.val+offset_in_sector,buffer+offset_into_buffer,maxwrite);
         offset_into_buffer += maxwrite;
         file.currentoffset += maxwrite;
         offset_in_sector += maxwrite;
 
         if(offset_in_sector >= GetAllocationUnitSize()){
-            auto next = GetFAT12_entry(file.currentAU);
+            auto next = GetFAT_entry(file.currentAU);
             if(!next.Ok())return{(int)Fat12Status::ERROR};
-            if(next.val == END_OF_FILE){
+            if(IsEndOfChain(next.val)){
 
                 auto next_free_cluster = GetNextFreeCluster();
                 if(!next_free_cluster.Ok()){
                     return {(int)Fat12Status::ERROR};
                 }
-                SetFAT12_entry(file.currentAU,next_free_cluster.val);
-                SetFAT12_entry(next_free_cluster.val,END_OF_FILE);
+                SetFAT_entry(file.currentAU,next_free_cluster.val);
+                SetFAT_entry(next_free_cluster.val,EndOfChain());
                 file.currentAU = next_free_cluster.val;
             }else{
                 file.currentAU = next.val;
             }
         }
     }
-    FileEntry entry;
-    auto offset_entry = OffsetToFileHandle(file.handle);
-    if(!offset_entry.Ok()){return {(int)Fat12Status::OK};};
-    memcpy(&entry,disk + offset_entry.val,sizeof(FileEntry));
-    entry.DIR_FileSize = MAX(entry.DIR_FileSize, file.currentoffset);
-    memcpy(disk + offset_entry.val,&entry,sizeof(FileEntry));
+    if(file.currentoffset > openfile.val->entry.DIR_FileSize){
+        openfile.val->entry.DIR_FileSize = file.currentoffset;
+        openfile.val->dirty = true;
+    }
     return {(int)Fat12Status::OK,buffersize};
 
 }
 
-Result<none> FAT12::CreateDir(const char name[8],const char extension[3], Directory parent,FileHandle* filehandle)
+Result<none> FAT12::CreateDirUntraced(const char name[8],const char extension[3], Directory parent,FileHandle* filehandle)
 {
+    if(readonly)return {(int)Fat12Status::READ_ONLY};
     FileEntry dir;
     size_t namelen = strnlen(name,8);
     size_t extensionlen = strnlen(extension,3);
@@ -1076,10 +3241,11 @@ Result<none> FAT12::CreateDir(const char name[8],const char extension[3], Direct
     auto firstcluster = GetNextFreeCluster();
     if(!firstcluster.Ok())return {firstcluster.status};
 
-    SetFAT12_entry(firstcluster.val,0xfff);
+    SetFAT_entry(firstcluster.val,EndOfChain());
     if(firstcluster.val == 0)return {(int)Fat12Status::ERROR};
+    ClearCluster(firstcluster.val);
 
-    dir.DIR_FstClusLO = firstcluster.val;
+    dir.SetFirstCluster(firstcluster.val);
     dir.DIR_FileSize = 0;
 
     FileHandle newdirhandle;
@@ -1092,14 +3258,14 @@ Result<none> FAT12::CreateDir(const char name[8],const char extension[3], Direct
 
     if(!offsettofilehandle_res.Ok())return {(int)Fat12Status::ERROR};
     
-    memcpy(disk +
+    WriteDisk(
         offsettofilehandle_res.val,
         &dir,
         sizeof(dir)
     );
 
-    FileHandle df{dir.DIR_FstClusLO,0};
-    FileHandle ddf{dir.DIR_FstClusLO,1};
+    FileHandle df{dir.FirstCluster(),0};
+    FileHandle ddf{dir.FirstCluster(),1};
 
     FileEntry dot = dir;
     memset(dot.DIR_Name,0x20,sizeof(dot.DIR_Name));
@@ -1109,7 +3275,7 @@ Result<none> FAT12::CreateDir(const char name[8],const char extension[3], Direct
     auto offset_df = OffsetToFileHandle(df);
     if(!offset_df.Ok())return {(int)Fat12Status::ERROR};
 
-    memcpy(disk +
+    WriteDisk(
         offset_df.val,
         &dot,
         sizeof(dot)
@@ -1119,7 +3285,12 @@ Result<none> FAT12::CreateDir(const char name[8],const char extension[3], Direct
     memset(dotdot.DIR_Name,0x20,sizeof(dot.DIR_Name));
     memcpy(dotdot.DIR_Name,"..",2);
 
-    dotdot.DIR_FstClusLO = parent.fat_entry;
+    // ".." of a directory in the root always points at cluster 0, even on FAT32.
+    uint32_t parentcluster = parent.fat_entry;
+    if(fattype == FatType::FAT32 && parentcluster == bpb32.BPB_RootClus){
+        parentcluster = 0;
+    }
+    dotdot.SetFirstCluster(parentcluster);
 
     FileHandle dotdotf{};
     
@@ -1128,7 +3299,7 @@ Result<none> FAT12::CreateDir(const char name[8],const char extension[3], Direct
     auto offset_ddf = OffsetToFileHandle(ddf);
     if(!offset_ddf.Ok())return {(int)Fat12Status::ERROR};
 
-    memcpy(disk +
+    WriteDisk(
         offset_ddf.val,
         &dotdot,
         sizeof(dotdot)
@@ -1143,30 +3314,83 @@ Result<none> FAT12::CreateDir(const char name[8],const char extension[3], Direct
 
 Result<bool> FAT12::DirectoryEmpty(Directory directory)
 {
-    for(FatIterator ent = directory.fat_entry; FatIteratorOK(ent); IterateFat(&ent)){ // root directory can be bigger than the standard allocation unit. So i need to implement a check for that.
-        for(  uint16_t i = 0; i < (bpb.BPB_BytsPerSec*bpb.BPB_SecPerClus / sizeof(FileEntry)); i++){
-            FileHandle f{ent,i};
-            FileEntry entry;//continue hereeeeeeeeee
-            auto result = GetFileEntryFromHanlde(f,&entry);
-            if(result.Ok()){
-                if(entry.DIR_Name[0] == 0xE5 || entry.DIR_Name[0] == 0x00){
-                    continue;
-                }
-                if(DirIsDotOrDotDot(&entry)){
-                    continue;
-                }
-                return {(int)Fat12Status::OK,false};
+    FileHandle f{directory.fat_entry,0};
+    while(true){
+        FileEntry entry;
+        if(!GetFileEntryFromHanlde(f,&entry).Ok())return {(int)Fat12Status::ERROR};
+        uint8_t fbyte = entry.DIR_Name[0];
+        if(fbyte == 0x00)break; // end of directory
+        if(fbyte != 0xE5 && !DirIsDotOrDotDot(&entry))return {(int)Fat12Status::OK,false};
+        auto next = GetNextEntryInDir(f);
+        if(!next.Ok())break;
+        f = next.val;
+    }
+    return {(int)Fat12Status::OK,true};
+}
+
+// Packs the live entries of dir to the front in their order, so long-name
+// runs stay whole, ends them with the 0x00 marker and frees the clusters
+// behind it. Entries move, so nothing in dir may be open. Not crash safe:
+// an interrupted compaction can leave an entry twice, which Check reports
+// as a crosslink. val is the number of clusters freed.
+Result<uint32_t> FAT12::CompactDirectoryUntraced(Directory dir)
+{
+    if(readonly)return {(int)Fat12Status::READ_ONLY};
+    uint32_t first = DirCluster(dir.fat_entry);
+    if(ChainHasOpenEntries(first))return {(int)Fat12Status::FILE_IS_OPEN};
+
+    FileHandle read{dir.fat_entry,0};
+    FileHandle write = read;
+    uint32_t lastused = first;
+    bool full = false;
+    while(true){
+        FileEntry entry;
+        if(!GetFileEntryFromHanlde(read,&entry).Ok())return {(int)Fat12Status::ERROR};
+        uint8_t fbyte = entry.DIR_Name[0];
+        if(fbyte == 0x00)break;
+        if(fbyte != 0xE5){
+            if(read.direntry != write.direntry || read.dirindex != write.dirindex){
+                auto offset = OffsetToFileHandle(write);
+                if(!offset.Ok())return {offset.status};
+                WriteDisk(offset.val,&entry,sizeof(entry));
+            }
+            lastused = DirCluster(write.direntry);
+            auto next = GetNextEntryInDir(write);
+            if(next.Ok()){
+                write = next.val;
             }else{
-                return {(int)Fat12Status::ERROR};
+                full = true;
             }
         }
+        auto next = GetNextEntryInDir(read);
+        if(!next.Ok())break;
+        read = next.val;
+    }
+
+    // New marker, and nothing stale behind it in the last cluster kept.
+    if(!full && DirCluster(write.direntry) == lastused){
+        auto offset = OffsetToFileHandle(write);
+        if(!offset.Ok())return {offset.status};
+        FillDisk(offset.val,0,(GetNumberOfFileEntriesPerCluster(write.direntry) - write.dirindex) * sizeof(FileEntry));
+    }
+
+    uint32_t freed = 0;
+    if(lastused >= 2){
+        auto next = GetFAT_entry(lastused);
+        if(!next.Ok())return {next.status};
+        if(!IsEndOfChain(next.val)){
+            CountExtents(next.val,&freed);
+            SetFAT_entry(lastused,EndOfChain());
+            auto released = FreeClusterChain(next.val);
+            if(!released.Ok())return {released.status};
+        }
     }
-    return {(int)Fat12Status::OK,false};
+    return {(int)Fat12Status::OK,freed};
 }
 
 int FAT12::SectorSerialDump(size_t index)
 {   
-    if(!(index < bpb.BPB_TotSec16))return (int)Fat12Status::ERROR;
+    if(!(index < TotalSectors()))return (int)Fat12Status::ERROR;
     uint8_t buf[bpb.BPB_BytsPerSec];
 
     memcpy(buf,disk+(index*bpb.BPB_BytsPerSec),bpb.BPB_BytsPerSec);
@@ -1182,13 +3406,450 @@ int FAT12::SectorSerialDump(size_t index)
     return (int)Fat12Status::OK;
 }
 
-Result<none> FAT12::Mount()
+// Only checks the boot sector, so it takes the same time on any volume.
+// Allocation works straight away; free space is counted on first need, or
+// ahead of it through MountStep.
+Result<none> FAT12::MountUntraced()
 {
     
+    memset(openfiles,0,sizeof(openfiles));
+    defragcursor = 0;
+    readonly = false;
+    pathindex = nullptr;
+    pathindexcount = 0;
+    pathindexready = false;
+    ResetAllocationState();
     auto result = ReadFirst512bytes(&bpb);
-    bool fat12 = IsFAT12(&bpb);
-    if(fat12 && (result.Ok()))return {(int)Fat12Status::OK};
-    return {(int)Fat12Status::ERROR};
+    if(!result.Ok())return {(int)Fat12Status::ERROR};
+    memcpy(&bpb32,disk+BPB_FAT32_OFFSET,sizeof(bpb32));
+    auto type = DetermineFatType(&bpb,&bpb32);
+    if(!type.Ok())return {(int)Fat12Status::ERROR};
+    fattype = type.val;
+    // A partition's BPB must not reach into whatever follows it.
+    if((size_t)TotalSectors() * bpb.BPB_BytsPerSec > disk_size)return {(int)Fat12Status::ERROR};
+    return {(int)Fat12Status::OK};
+}
+
+// Does up to budget FAT entries of the work Mount leaves for later, for
+// idle time after startup. The path index of a read-only mount is built
+// in the step after the count, in one go. True once nothing is left.
+Result<bool> FAT12::MountStepUntraced(size_t budget)
+{
+    auto scanned = ScanFreeClusters(budget);
+    if(!scanned.Ok() || !scanned.val)return scanned;
+    if(pathindex && !pathindexready){
+        auto indexed = EnsurePathIndex();
+        if(!indexed.Ok())return {indexed.status};
+    }
+    return {(int)Fat12Status::OK,true};
+}
+
+// A FAT boot sector rather than an MBR: both end in 0x55AA, but only the
+// former starts with a jump and carries a BPB that adds up.
+bool FAT12::IsBootSector(const uint8_t *sector)
+{
+    if(sector[0] != 0xEB && sector[0] != 0xE9)return false;
+    BPB bpb;
+    BPB_FAT32 bpb32;
+    memcpy(&bpb,sector,sizeof(bpb));
+    memcpy(&bpb32,sector + BPB_FAT32_OFFSET,sizeof(bpb32));
+    uint16_t bps = bpb.BPB_BytsPerSec;
+    if(bps < 512 || bps > 4096 || (bps & (bps - 1)) != 0)return false;
+    if(bpb.BPB_SecPerClus & (bpb.BPB_SecPerClus - 1))return false;
+    if(bpb.BPB_NumFATs == 0 || bpb.BPB_RsvdSecCnt == 0)return false;
+    return DetermineFatType(&bpb,&bpb32).Ok();
+}
+
+// Finds the FAT volumes on a device: the whole device when it starts with
+// a boot sector, else the FAT partitions of its MBR in table order.
+// Extended partitions are not followed. val is the number written to out.
+Result<size_t> FAT12::ReadPartitionTable(const uint8_t *device, size_t device_size, Partition *out, size_t max)
+{
+    if(!device || !out)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    if(device_size < MBR_SECTOR_SIZE)return {(int)Fat12Status::ERROR};
+    if(device[510] != 0x55 || device[511] != 0xAA)return {(int)Fat12Status::NO_MAGICBYTES};
+    if(IsBootSector(device)){
+        if(max == 0)return {(int)Fat12Status::OUT_OF_SPACE};
+        out[0] = Partition{0,false,0,device_size};
+        return {(int)Fat12Status::OK,1};
+    }
+    size_t found = 0;
+    for(size_t i = 0; i < MBR_PARTITION_ENTRIES; i++){
+        const uint8_t* entry = device + MBR_PARTITION_TABLE_OFFSET + i*16;
+        uint8_t type = entry[4];
+        switch(type){
+            case 0x01: // FAT12
+            case 0x04: // FAT16 below 32 MiB
+            case 0x06: // FAT16
+            case 0x0B: // FAT32
+            case 0x0C: // FAT32, LBA
+            case 0x0E: // FAT16, LBA
+                break;
+            default:
+                continue;
+        }
+        uint32_t firstlba,sectors;
+        memcpy(&firstlba,entry + 8,sizeof(firstlba));
+        memcpy(&sectors,entry + 12,sizeof(sectors));
+        size_t offset = (size_t)firstlba * MBR_SECTOR_SIZE;
+        size_t size = (size_t)sectors * MBR_SECTOR_SIZE;
+        if(firstlba == 0 || sectors == 0 || offset >= device_size || size > device_size - offset)return {(int)Fat12Status::ERROR};
+        if(found == max)return {(int)Fat12Status::OUT_OF_SPACE,found};
+        out[found++] = Partition{type,(entry[0] & 0x80) != 0,offset,size};
+    }
+    return {(int)Fat12Status::OK,found};
+}
+
+// Mounts for lookups only: every call that would change the volume fails
+// with READ_ONLY. Files are found by full path through a sorted index in
+// the caller's buffers, loaded from PATH_INDEX_NAME when that is still
+// current, else built by walking the tree. The index is made by the first
+// lookup or MountStep, which fail with OUT_OF_SPACE when the buffers are
+// too small for the tree. Without buffers the volume is mounted read-only
+// with no path lookups, e.g. for a disk that cannot be written at all.
+Result<none> FAT12::MountReadOnlyUntraced(PathIndexEntry *entries, size_t capacity, char *paths, size_t pathcapacity)
+{
+    if(!entries != !paths)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    auto mounted = Mount();
+    if(!mounted.Ok())return mounted;
+    pathindex = entries;
+    pathindexcapacity = capacity;
+    pathpool = paths;
+    pathpoolcapacity = pathcapacity;
+    readonly = true;
+    return {(int)Fat12Status::OK};
+}
+
+Result<none> FAT12::EnsurePathIndex()
+{
+    if(!pathindex)return {(int)Fat12Status::ERROR};
+    if(pathindexready)return {(int)Fat12Status::OK};
+    if(!LoadPathIndex().Ok()){
+        auto built = BuildPathIndex(pathindex,pathindexcapacity,pathpool,pathpoolcapacity);
+        if(!built.Ok())return built;
+    }
+    pathindexready = true;
+    return {(int)Fat12Status::OK};
+}
+
+// Writes the index MountReadOnly would build to PATH_INDEX_NAME, replacing
+// any older one. The buffers are only used while saving.
+Result<none> FAT12::SavePathIndexUntraced(PathIndexEntry *entries, size_t capacity, char *paths, size_t pathcapacity)
+{
+    if(readonly)return {(int)Fat12Status::READ_ONLY};
+    if(!entries || !paths)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    auto old = GetShortNameInDir({0},PATH_INDEX_NAME,SHORTNAME_LEN);
+    if(old.Ok()){
+        auto deleted = DeleteFile(old.val);
+        if(!deleted.Ok())return deleted;
+    }
+    auto built = BuildPathIndex(entries,capacity,paths,pathcapacity);
+    if(built.Ok())built = WritePathIndex();
+    // The index is only meant for read-only mounts.
+    pathindex = nullptr;
+    pathindexcount = 0;
+    return built;
+}
+
+Result<none> FAT12::WritePathIndex()
+{
+    PathIndexHeader header{PATH_INDEX_MAGIC,0,(uint32_t)pathindexcount,(uint32_t)pathpoolsize};
+    size_t total = sizeof(header) + pathindexcount*sizeof(PathIndexEntry) + pathpoolsize;
+    FileHandle file;
+    auto created = CreateFile(PATH_INDEX_NAME,PATH_INDEX_NAME + 8,{0},&file);
+    if(!created.Ok())return created;
+    auto io = Open(file,FILE_MODE_WRITE);
+    if(!io.Ok())return {io.status};
+    auto reserved = Preallocate(file,total);
+    auto written = reserved.Ok() ? Write(io.val,(const uint8_t*)&header,sizeof(header)) : Result<size_t>{reserved.status};
+    if(written.Ok())written = Write(io.val,(const uint8_t*)pathindex,pathindexcount*sizeof(PathIndexEntry));
+    if(written.Ok())written = Write(io.val,(const uint8_t*)pathpool,pathpoolsize);
+    auto closed = Close(&io.val);
+    if(!written.Ok())return {written.status};
+    if(!closed.Ok())return closed;
+
+    // The stamp covers the index file's own entry and chain, so it goes in
+    // last, straight into the data.
+    FileEntry entry;
+    if(!GetFileEntryFromHanlde(file,&entry).Ok())return {(int)Fat12Status::ERROR};
+    auto offset = OffsetToCluster(entry.FirstCluster());
+    if(!offset.Ok())return {offset.status};
+    header.stamp = PathIndexStamp();
+    WriteDisk(offset.val + offsetof(PathIndexHeader,stamp),&header.stamp,sizeof(header.stamp));
+    return {(int)Fat12Status::OK};
+}
+
+Result<none> FAT12::LoadPathIndex()
+{
+    auto file = GetShortNameInDir({0},PATH_INDEX_NAME,SHORTNAME_LEN);
+    if(!file.Ok())return {(int)Fat12Status::FILE_DOES_NOT_EXIST};
+    auto io = Open(file.val,FILE_MODE_READ);
+    if(!io.Ok())return {io.status};
+    PathIndexHeader header;
+    auto read = Read(io.val,(uint8_t*)&header,sizeof(header));
+    bool ok = read.Ok() && read.val == sizeof(header) && header.magic == PATH_INDEX_MAGIC
+        && header.count <= pathindexcapacity && header.pathsize <= pathpoolcapacity
+        && openfiles[io.val.slot].entry.DIR_FileSize == sizeof(header) + header.count*sizeof(PathIndexEntry) + header.pathsize;
+    if(ok){
+        size_t length = header.count*sizeof(PathIndexEntry);
+        read = Read(io.val,(uint8_t*)pathindex,length);
+        ok = read.Ok() && read.val == length;
+    }
+    if(ok){
+        read = Read(io.val,(uint8_t*)pathpool,header.pathsize);
+        ok = read.Ok() && read.val == header.pathsize;
+    }
+    Close(&io.val);
+    if(!ok)return {(int)Fat12Status::ERROR};
+    pathindexcount = header.count;
+    pathpoolsize = header.pathsize;
+    for(size_t i = 0; i < pathindexcount; i++){
+        if((size_t)pathindex[i].path + pathindex[i].pathlength > pathpoolsize)return {(int)Fat12Status::ERROR};
+    }
+    // Anything written since the index was saved shows up in a directory.
+    if(PathIndexStamp() != header.stamp)return {(int)Fat12Status::ERROR};
+    return {(int)Fat12Status::OK};
+}
+
+Result<none> FAT12::BuildPathIndex(PathIndexEntry *entries, size_t capacity, char *paths, size_t pathcapacity)
+{
+    pathindex = entries;
+    pathindexcapacity = capacity;
+    pathindexcount = 0;
+    pathpool = paths;
+    pathpoolcapacity = pathcapacity;
+    pathpoolsize = 0;
+    auto indexed = IndexDirectory(0,0,0,0);
+    if(!indexed.Ok())return indexed;
+    SortPathIndex();
+    return {(int)Fat12Status::OK};
+}
+
+// Appends every entry below cluster, whose own path is the prefixlength
+// bytes at prefix. Long names are put together slot by slot on the way,
+// since the slots come before their short entry, right where the path's
+// name goes in the pool; that keeps the frame small for deep trees.
+Result<none> FAT12::IndexDirectory(uint32_t cluster, uint32_t prefix, uint16_t prefixlength, unsigned depth)
+{
+    if(depth >= FAT12_FSCK_MAX_DEPTH)return {(int)Fat12Status::INDEX_OUT_OF_RANGE};
+    size_t longnamelength = 0;
+    uint8_t longnamesum = 0;
+    uint8_t longnameord = 0;
+
+    FileHandle fh{cluster,0};
+    for(bool first = true; ; first = false){
+        if(!first){
+            auto next = GetNextEntryInDir(fh);
+            if(!next.Ok())break;
+            fh = next.val;
+        }
+        FileEntry entry;
+        if(!GetFileEntryFromHanlde(fh,&entry).Ok())return {(int)Fat12Status::ERROR};
+        uint8_t fbyte = entry.DIR_Name[0];
+        if(fbyte == 0x00)break;
+        if(fbyte == 0xE5){
+            longnameord = 0;
+            continue;
+        }
+        if((entry.DIR_Attr & 0x3f) == ATTR_LONG_NAME){
+            const LongNameEntry* lne = (const LongNameEntry*)&entry;
+            uint8_t ord = lne->LDIR_ord & ~LAST_LONG_ENTRY;
+            bool last = lne->LDIR_ord & LAST_LONG_ENTRY;
+            if(ord == 0 || ord > 20 || (!last && (ord + 1 != longnameord || lne->LDIR_Chksum != longnamesum))){
+                longnameord = 0;
+                continue;
+            }
+            longnameord = ord;
+            longnamesum = lne->LDIR_Chksum;
+            // Thirteen UCS-2 characters per slot; only the low byte is kept.
+            uint8_t chars[26];
+            memcpy(chars,lne->LDIR_Name1,10);
+            memcpy(chars + 10,lne->LDIR_Name2,12);
+            memcpy(chars + 22,lne->LDIR_Name3,4);
+            size_t namestart = pathpoolsize + prefixlength + (prefixlength ? 1 : 0);
+            size_t at = (ord - 1)*13;
+            if(last)longnamelength = at + 13;
+            for(size_t c = 0; c < 13; c++,at++){
+                if(chars[c*2] == 0 && chars[c*2 + 1] == 0){
+                    if(last)longnamelength = at;
+                    break;
+                }
+                if(at >= 255){
+                    // No terminator by the longest legal name: corrupt.
+                    longnameord = 0;
+                    break;
+                }
+                // A name past the pool fails below, when its path is added.
+                if(namestart + at < pathpoolcapacity)pathpool[namestart + at] = chars[c*2 + 1] ? '?' : chars[c*2];
+            }
+            continue;
+        }
+        bool haslongname = longnameord == 1 && LongNameChecksum(entry.DIR_Name) == longnamesum;
+        longnameord = 0;
+        if((entry.DIR_Attr & ATTR_VOLUME_ID) || fbyte == '.')continue;
+        if(cluster == 0 && memcmp(entry.DIR_Name,PATH_INDEX_NAME,SHORTNAME_LEN) == 0)continue;
+
+        const char* name = pathpool + pathpoolsize + prefixlength + (prefixlength ? 1 : 0);
+        size_t namelength = longnamelength;
+        char shortname[SHORTNAME_LEN + 1];
+        if(!haslongname){
+            // "NAME.EXT" without the padding
+            namelength = 0;
+            for(size_t i = 0; i < 8 && entry.DIR_Name[i] != ' '; i++)shortname[namelength++] = entry.DIR_Name[i];
+            if(entry.DIR_Name[8] != ' ')shortname[namelength++] = '.';
+            for(size_t i = 8; i < SHORTNAME_LEN && entry.DIR_Name[i] != ' '; i++)shortname[namelength++] = entry.DIR_Name[i];
+            name = shortname;
+        }
+
+        size_t pathlength = prefixlength + (prefixlength ? 1 : 0) + namelength;
+        if(pathindexcount == pathindexcapacity || pathpoolsize + pathlength > pathpoolcapacity || pathlength > UINT16_MAX){
+            return {(int)Fat12Status::OUT_OF_SPACE};
+        }
+        PathIndexEntry& indexed = pathindex[pathindexcount++];
+        memset(&indexed,0,sizeof(indexed));
+        indexed.path = pathpoolsize;
+        indexed.pathlength = pathlength;
+        char* path = pathpool + pathpoolsize;
+        memcpy(path,pathpool + prefix,prefixlength);
+        if(prefixlength)path[prefixlength] = '/';
+        memmove(path + pathlength - namelength,name,namelength);
+        pathpoolsize += pathlength;
+
+        indexed.attr = entry.DIR_Attr;
+        indexed.firstcluster = entry.FirstCluster();
+        indexed.size = entry.DIR_FileSize;
+        indexed.handle = fh;
+        uint32_t clusters = 0;
+        indexed.extents = indexed.firstcluster >= 2 ? CountExtents(indexed.firstcluster,&clusters) : 0;
+
+        if((entry.DIR_Attr & ATTR_DIRECTORY) && indexed.firstcluster >= 2){
+            auto sub = IndexDirectory(indexed.firstcluster,indexed.path,indexed.pathlength,depth + 1);
+            if(!sub.Ok())return sub;
+        }
+    }
+    return {(int)Fat12Status::OK};
+}
+
+int FAT12::ComparePath(const PathIndexEntry &entry, const char *path, size_t len)const
+{
+    int order = memcmp(pathpool + entry.path,path,MIN((size_t)entry.pathlength,len));
+    if(order != 0)return order;
+    return entry.pathlength < len ? -1 : entry.pathlength > len ? 1 : 0;
+}
+
+// Heapsort: in place and without recursion, whatever the tree looks like.
+void FAT12::SortPathIndex()
+{
+    size_t n = pathindexcount;
+    auto before = [this](size_t a, size_t b){
+        return ComparePath(pathindex[a],pathpool + pathindex[b].path,pathindex[b].pathlength) < 0;
+    };
+    auto siftdown = [&](size_t root, size_t end){
+        while(root*2 + 1 < end){
+            size_t child = root*2 + 1;
+            if(child + 1 < end && before(child,child + 1))child++;
+            if(!before(root,child))return;
+            PathIndexEntry swap = pathindex[root];
+            pathindex[root] = pathindex[child];
+            pathindex[child] = swap;
+            root = child;
+        }
+    };
+    for(size_t i = n/2; i > 0; i--)siftdown(i - 1,n);
+    for(size_t end = n; end > 1; end--){
+        PathIndexEntry swap = pathindex[0];
+        pathindex[0] = pathindex[end - 1];
+        pathindex[end - 1] = swap;
+        siftdown(0,end - 1);
+    }
+}
+
+Result<const PathIndexEntry *> FAT12::LookupPathUntraced(const char *path, size_t len)
+{
+    if(!path)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    auto ready = EnsurePathIndex();
+    if(!ready.Ok())return {ready.status};
+    if(len > 0 && path[0] == '/'){
+        path++;
+        len--;
+    }
+    size_t low = 0;
+    size_t high = pathindexcount;
+    while(low < high){
+        size_t middle = low + (high - low)/2;
+        int order = ComparePath(pathindex[middle],path,len);
+        if(order == 0)return {(int)Fat12Status::OK,&pathindex[middle]};
+        if(order < 0){
+            low = middle + 1;
+        }else{
+            high = middle;
+        }
+    }
+    return {(int)Fat12Status::FILE_DOES_NOT_EXIST};
+}
+
+// Opens for reading straight from the index, without reading the
+// directory entry back.
+Result<FileIOHandle> FAT12::OpenPathUntraced(const char *path, size_t len)
+{
+    auto found = LookupPath(path,len);
+    if(!found.Ok())return {found.status};
+    const PathIndexEntry* indexed = found.val;
+    if(indexed->attr & ATTR_DIRECTORY)return {(int)Fat12Status::ERROR};
+    FileEntry entry;
+    memset(&entry,0,sizeof(entry));
+    entry.DIR_Attr = indexed->attr;
+    entry.SetFirstCluster(indexed->firstcluster);
+    entry.DIR_FileSize = indexed->size;
+
+    FileIOHandle fileio;
+    memset(&fileio,0,sizeof(fileio));
+    fileio.handle = indexed->handle;
+    auto openfile = AcquireOpenFile(indexed->handle,&entry);
+    if(!openfile.Ok())return {openfile.status};
+    fileio.slot = openfile.val - openfiles;
+    if(++lastfileid == 0)lastfileid = 1;
+    fileio.id = lastfileid;
+    fileio.mode = FILE_IO_READ;
+    fileio.currentAU = indexed->firstcluster;
+    return {(int)Fat12Status::OK,fileio};
+}
+
+// FNV-1a over the clusters of a chain.
+uint32_t FAT12::HashChain(uint32_t hash, uint32_t first)
+{
+    size_t guard = GetNumberOfValidFatEntries();
+    for(FatIterator it = first; it >= 2 && FatIteratorOK(it) && guard > 0; IterateFat(&it), guard--){
+        auto offset = OffsetToCluster(it);
+        if(!offset.Ok())break;
+        const uint8_t* data = disk + offset.val;
+        for(size_t i = 0; i < GetAllocationUnitSize(); i++){
+            hash = (hash ^ data[i]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+// Hash of every directory, root first. Paths, sizes and first clusters
+// all live there; a chain changed behind an unchanged entry (Defragment
+// moving the middle of a file) only leaves extents out of date. This reads
+// as much as a build does: a generation counter would be cheaper but is
+// not bumped by other FAT drivers writing the same volume.
+uint32_t FAT12::PathIndexStamp()
+{
+    uint32_t hash = 2166136261u;
+    if(fattype == FatType::FAT32){
+        hash = HashChain(hash,bpb32.BPB_RootClus);
+    }else{
+        const uint8_t* root = disk + OffsetToRootDir();
+        for(size_t i = 0; i < RootDirSize(); i++){
+            hash = (hash ^ root[i]) * 16777619u;
+        }
+    }
+    for(size_t i = 0; i < pathindexcount; i++){
+        if(pathindex[i].attr & ATTR_DIRECTORY)hash = HashChain(hash,pathindex[i].firstcluster);
+    }
+    return hash;
 }
 
 
@@ -1211,3 +3872,328 @@ void BPB::print()
     PRINT_X(BS_BootSig);
     PRINT_X(BS_VolID);
 }
+
+// Records every public call below while a callback is installed. Calls
+// made from inside another public call are part of that call's cost and
+// are not recorded, so a replay does each one exactly once.
+void FAT12::SetTraceCallback(TraceCallback callback, TraceClock clock, void *context)
+{
+    tracecallback = callback;
+    traceclock = clock;
+    tracecontext = context;
+}
+
+uint32_t FAT12::TraceBegin()
+{
+    tracedepth++;
+    if(!tracecallback || !traceclock || tracedepth != 1)return 0;
+    return traceclock(tracecontext);
+}
+
+void FAT12::TraceEnd(uint32_t start, TraceOp op, int status, uint16_t id, FileHandle target, uint32_t arg, uint32_t arg2, uint32_t result, const char *name, size_t namelength)
+{
+    tracedepth--;
+    if(!tracecallback || tracedepth != 0)return;
+    TraceRecord record;
+    record.time = start;
+    record.duration = traceclock ? traceclock(tracecontext) - start : 0;
+    record.op = (uint8_t)op;
+    record.status = (uint8_t)status;
+    record.id = id;
+    record.target = target.direntry;
+    record.dirindex = target.dirindex;
+    record.namelength = name ? (uint16_t)MIN(namelength,(size_t)UINT16_MAX) : 0;
+    record.arg = arg;
+    record.arg2 = arg2;
+    record.result = result;
+    tracecallback(tracecontext,&record,name);
+}
+
+Result<none> FAT12::Mount()
+{
+    uint32_t start = TraceBegin();
+    auto mounted = MountUntraced();
+    TraceEnd(start,TraceOp::MOUNT,mounted.status,0,{0,0},0,0,0);
+    return mounted;
+}
+
+Result<bool> FAT12::MountStep(size_t budget)
+{
+    uint32_t start = TraceBegin();
+    auto step = MountStepUntraced(budget);
+    TraceEnd(start,TraceOp::MOUNT_STEP,step.status,0,{0,0},budget,0,step.Ok() && step.val);
+    return step;
+}
+
+Result<none> FAT12::MountReadOnly(PathIndexEntry *entries, size_t capacity, char *paths, size_t pathcapacity)
+{
+    uint32_t start = TraceBegin();
+    auto mounted = MountReadOnlyUntraced(entries,capacity,paths,pathcapacity);
+    TraceEnd(start,TraceOp::MOUNT_READ_ONLY,mounted.status,0,{0,0},capacity,pathcapacity,0);
+    return mounted;
+}
+
+Result<none> FAT12::SavePathIndex(PathIndexEntry *entries, size_t capacity, char *paths, size_t pathcapacity)
+{
+    uint32_t start = TraceBegin();
+    auto saved = SavePathIndexUntraced(entries,capacity,paths,pathcapacity);
+    TraceEnd(start,TraceOp::SAVE_PATH_INDEX,saved.status,0,{0,0},capacity,pathcapacity,0);
+    return saved;
+}
+
+// 8.3 names are traced space-padded, the way they end up in the entry.
+static void TraceShortName(char out[SHORTNAME_LEN], const char name[8], const char extension[3])
+{
+    memset(out,0x20,SHORTNAME_LEN);
+    memcpy(out,name,strnlen(name,8));
+    memcpy(out + 8,extension,strnlen(extension,3));
+}
+
+Result<none> FAT12::CreateDir(const char name[8], const char extension[3], Directory parent, FileHandle *filehandle)
+{
+    uint32_t start = TraceBegin();
+    auto created = CreateDirUntraced(name,extension,parent,filehandle);
+    char shortname[SHORTNAME_LEN];
+    if(tracecallback)TraceShortName(shortname,name,extension);
+    TraceEnd(start,TraceOp::CREATE_DIR,created.status,0,{parent.fat_entry,0},0,0,0,shortname,SHORTNAME_LEN);
+    return created;
+}
+
+Result<none> FAT12::CreateFile(const char name[8], const char extension[3], Directory parent, FileHandle *filehandle)
+{
+    uint32_t start = TraceBegin();
+    auto created = CreateFileUntraced(name,extension,parent,filehandle);
+    char shortname[SHORTNAME_LEN];
+    if(tracecallback)TraceShortName(shortname,name,extension);
+    TraceEnd(start,TraceOp::CREATE_FILE,created.status,0,{parent.fat_entry,0},0,0,0,shortname,SHORTNAME_LEN);
+    return created;
+}
+
+// One record per name, all with the batch's start and status; a replay
+// collects them back into a single call.
+Result<size_t> FAT12::CreateFiles(Directory dir, const char *const *names, const size_t *lens, size_t count, FileHandle *out)
+{
+    uint32_t start = TraceBegin();
+    auto created = CreateFilesUntraced(dir,names,lens,count,out);
+    if(count == 0 || !names || !lens){
+        TraceEnd(start,TraceOp::CREATE_FILES,created.status,0,{dir.fat_entry,0},count,0,0);
+        return created;
+    }
+    for(size_t i = 0; i < count; i++){
+        if(i > 0)tracedepth++;
+        TraceEnd(start,TraceOp::CREATE_FILES,created.status,0,{dir.fat_entry,0},count,i,created.Ok() ? created.val : 0,names[i],lens[i]);
+    }
+    return created;
+}
+
+Result<none> FAT12::DeleteFile(FileHandle filehandle)
+{
+    uint32_t start = TraceBegin();
+    auto deleted = DeleteFileUntraced(filehandle);
+    TraceEnd(start,TraceOp::DELETE_FILE,deleted.status,0,filehandle,0,0,0);
+    return deleted;
+}
+
+Result<none> FAT12::Rename(FileHandle filehandle, Directory newparent, const char *name, size_t len, FileHandle *out)
+{
+    uint32_t start = TraceBegin();
+    auto renamed = RenameUntraced(filehandle,newparent,name,len,out);
+    TraceEnd(start,TraceOp::RENAME,renamed.status,0,filehandle,newparent.fat_entry,0,0,name,len);
+    return renamed;
+}
+
+Result<none> FAT12::CopyFile(FileHandle src, Directory dstdir, const char *name, size_t len, FileHandle *out)
+{
+    uint32_t start = TraceBegin();
+    auto copied = CopyFileUntraced(src,dstdir,name,len,out);
+    TraceEnd(start,TraceOp::COPY_FILE,copied.status,0,src,dstdir.fat_entry,0,0,name,len);
+    return copied;
+}
+
+Result<none> FAT12::RemoveTree(FileHandle filehandle, uint32_t *clustermap, size_t clustermapwords)
+{
+    uint32_t start = TraceBegin();
+    auto removed = RemoveTreeUntraced(filehandle,clustermap,clustermapwords);
+    TraceEnd(start,TraceOp::REMOVE_TREE,removed.status,0,filehandle,clustermapwords,0,0);
+    return removed;
+}
+
+Result<none> FAT12::ClearContentsOfFile(FileHandle filehandle)
+{
+    uint32_t start = TraceBegin();
+    auto cleared = ClearContentsOfFileUntraced(filehandle);
+    TraceEnd(start,TraceOp::CLEAR_CONTENTS,cleared.status,0,filehandle,0,0,0);
+    return cleared;
+}
+
+Result<none> FAT12::Preallocate(FileHandle filehandle, size_t bytes)
+{
+    uint32_t start = TraceBegin();
+    auto reserved = PreallocateUntraced(filehandle,bytes);
+    TraceEnd(start,TraceOp::PREALLOCATE,reserved.status,0,filehandle,bytes,0,0);
+    return reserved;
+}
+
+Result<uint32_t> FAT12::CompactDirectory(Directory dir)
+{
+    uint32_t start = TraceBegin();
+    auto compacted = CompactDirectoryUntraced(dir);
+    TraceEnd(start,TraceOp::COMPACT_DIRECTORY,compacted.status,0,{dir.fat_entry,0},0,0,compacted.Ok() ? compacted.val : 0);
+    return compacted;
+}
+
+Result<FileIOHandle> FAT12::Open(FileHandle file, uint8_t mode)
+{
+    uint32_t start = TraceBegin();
+    auto opened = OpenUntraced(file,mode);
+    TraceEnd(start,TraceOp::OPEN,opened.status,opened.Ok() ? opened.val.id : 0,file,mode,0,0);
+    return opened;
+}
+
+Result<FileIOHandle> FAT12::OpenPath(const char *path, size_t len)
+{
+    uint32_t start = TraceBegin();
+    auto opened = OpenPathUntraced(path,len);
+    TraceEnd(start,TraceOp::OPEN_PATH,opened.status,opened.Ok() ? opened.val.id : 0,{0,0},0,0,0,path,len);
+    return opened;
+}
+
+Result<const PathIndexEntry *> FAT12::LookupPath(const char *path, size_t len)
+{
+    uint32_t start = TraceBegin();
+    auto found = LookupPathUntraced(path,len);
+    TraceEnd(start,TraceOp::LOOKUP_PATH,found.status,0,{0,0},0,0,0,path,len);
+    return found;
+}
+
+Result<none> FAT12::Close(FileIOHandle *file)
+{
+    uint32_t start = TraceBegin();
+    uint16_t id = file ? file->id : 0;
+    auto closed = CloseUntraced(file);
+    TraceEnd(start,TraceOp::CLOSE,closed.status,id,{0,0},0,0,0);
+    return closed;
+}
+
+Result<none> FAT12::Flush(FileIOHandle &file)
+{
+    uint32_t start = TraceBegin();
+    auto flushed = FlushUntraced(file);
+    TraceEnd(start,TraceOp::FLUSH_FILE,flushed.status,file.id,{0,0},0,0,0);
+    return flushed;
+}
+
+Result<none> FAT12::Sync(FileIOHandle &file, FlushCallback callback, void *context)
+{
+    uint32_t start = TraceBegin();
+    auto synced = SyncUntraced(file,callback,context);
+    TraceEnd(start,TraceOp::SYNC,synced.status,file.id,{0,0},0,0,0);
+    return synced;
+}
+
+Result<none> FAT12::Flush(FlushCallback callback, void *context)
+{
+    uint32_t start = TraceBegin();
+    auto flushed = FlushUntraced(callback,context);
+    TraceEnd(start,TraceOp::FLUSH,flushed.status,0,{0,0},0,0,0);
+    return flushed;
+}
+
+Result<size_t> FAT12::Read(FileIOHandle &file, uint8_t *buffer, size_t buffersize)
+{
+    uint32_t start = TraceBegin();
+    auto read = ReadUntraced(file,buffer,buffersize);
+    TraceEnd(start,TraceOp::READ,read.status,file.id,{0,0},buffersize,0,read.Ok() ? read.val : 0);
+    return read;
+}
+
+Result<size_t> FAT12::Write(FileIOHandle &file, const uint8_t *buffer, size_t buffersize)
+{
+    uint32_t start = TraceBegin();
+    auto written = WriteUntraced(file,buffer,buffersize);
+    TraceEnd(start,TraceOp::WRITE,written.status,file.id,{0,0},buffersize,0,written.Ok() ? written.val : 0);
+    return written;
+}
+
+Result<none> FAT12::SetWriteBuffer(FileIOHandle &file, uint8_t *buffer, size_t buffersize)
+{
+    uint32_t start = TraceBegin();
+    auto set = SetWriteBufferUntraced(file,buffer,buffersize);
+    TraceEnd(start,TraceOp::SET_WRITE_BUFFER,set.status,file.id,{0,0},buffer ? buffersize : 0,0,0);
+    return set;
+}
+
+Result<none> FAT12::SetAllocationPolicy(AllocationPolicy policy, uint32_t *wearcounts, size_t wearcountblocks)
+{
+    uint32_t start = TraceBegin();
+    auto set = SetAllocationPolicyUntraced(policy,wearcounts,wearcountblocks);
+    TraceEnd(start,TraceOp::SET_ALLOCATION_POLICY,set.status,0,{0,0},(uint32_t)policy,wearcounts ? wearcountblocks : 0,0);
+    return set;
+}
+
+Result<uint32_t> FAT12::Defragment(uint32_t budget, bool directories, FlushCallback callback, void *context)
+{
+    uint32_t start = TraceBegin();
+    auto moved = DefragmentUntraced(budget,directories,callback,context);
+    TraceEnd(start,TraceOp::DEFRAGMENT,moved.status,0,{0,0},budget,directories,moved.Ok() ? moved.val : 0);
+    return moved;
+}
+
+Result<FileHandle> FAT12::GetShortNameInDir(Directory dir, const char *shortname, size_t shortname_len)
+{
+    uint32_t start = TraceBegin();
+    auto found = GetShortNameInDirUntraced(dir,shortname,shortname_len);
+    TraceEnd(start,TraceOp::GET_SHORT_NAME,found.status,0,{dir.fat_entry,0},0,0,0,shortname,shortname_len);
+    return found;
+}
+
+Result<FileHandle> FAT12::GetLongNameInDir(Directory dir, const char *longname, size_t longname_len)
+{
+    uint32_t start = TraceBegin();
+    auto found = GetLongNameInDirUntraced(dir,longname,longname_len);
+    TraceEnd(start,TraceOp::GET_LONG_NAME,found.status,0,{dir.fat_entry,0},0,0,0,longname,longname_len);
+    return found;
+}
+
+uint64_t FAT12::GetFreeDiskSpaceAmount()
+{
+    uint32_t start = TraceBegin();
+    uint64_t bytes = GetFreeDiskSpaceAmountUntraced();
+    // The record holds clusters, since the byte count need not fit 32 bits.
+    size_t au = GetAllocationUnitSize();
+    TraceEnd(start,TraceOp::GET_FREE_SPACE,(int)Fat12Status::OK,0,{0,0},au,0,bytes/au);
+    return bytes;
+}
+
+Result<none> FAT12::Format(const char *volumename, BytesPerSector bytespersector, uint8_t SectorPerClusters, bool dual_FATs, size_t SectorsInRootEntry, uint8_t flags)
+{
+    uint32_t start = TraceBegin();
+    auto formatted = FormatUntraced(volumename,bytespersector,SectorPerClusters,dual_FATs,SectorsInRootEntry,flags);
+    uint32_t layout = SectorPerClusters | (uint32_t)dual_FATs << 8 | (uint32_t)flags << 16;
+    TraceEnd(start,TraceOp::FORMAT,formatted.status,0,{(uint32_t)SectorsInRootEntry,0},bytespersector,layout,0,volumename,volumename ? strnlen(volumename,11) : 0);
+    return formatted;
+}
+
+Result<FsckReport> FAT12::Check(uint32_t *clustermap, size_t clustermapwords, bool repair, unsigned threads)
+{
+    uint32_t start = TraceBegin();
+    auto checked = CheckUntraced(clustermap,clustermapwords,repair,threads);
+    TraceEnd(start,TraceOp::CHECK,checked.status,0,{repair,0},clustermapwords,threads,0);
+    return checked;
+}
+
+Result<none> FAT12::EnableDirtyTracking(uint32_t *bitmap, size_t bitmapwords, size_t eraseblocksize)
+{
+    uint32_t start = TraceBegin();
+    auto enabled = EnableDirtyTrackingUntraced(bitmap,bitmapwords,eraseblocksize);
+    TraceEnd(start,TraceOp::ENABLE_DIRTY_TRACKING,enabled.status,0,{0,0},bitmap ? bitmapwords : 0,eraseblocksize,0);
+    return enabled;
+}
+
+Result<none> FAT12::FlushRange(size_t offset, size_t length, FlushCallback callback, void *context)
+{
+    uint32_t start = TraceBegin();
+    auto flushed = FlushRangeUntraced(offset,length,callback,context);
+    TraceEnd(start,TraceOp::FLUSH_RANGE,flushed.status,0,{0,0},offset,length,0);
+    return flushed;
+}
@@ -2,10 +2,27 @@
 #define FAT12_H
 
 #include <stdint.h>
+#if __has_include(<pico/stdlib.h>)
 #include <pico/stdlib.h>
+#else
+// Host build (image tools, tests): provide what the pico SDK would.
+#define FAT12_HOST 1
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef MIN
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#endif
+#ifndef MAX
+#define MAX(a,b) ((a)>(b)?(a):(b))
+#endif
+static inline void panic(const char* msg){fprintf(stderr,"%s\n",msg);abort();}
+#endif
 #include <string.h>
 
 #define END_OF_FILE 0xfff
+#define FAT16_END_OF_FILE 0xffff
+#define FAT32_END_OF_FILE 0x0fffffff
+#define FAT32_ENTRY_MASK 0x0fffffff
 
 #define ATTR_READ_ONLY 0x01
 #define ATTR_HIDDEN    0x02
@@ -30,7 +47,7 @@
 #define FILE_MODE_APP   0x02
 
 
-#pragma pack(1)
+#pragma pack(push,1)
 struct BPB{
     uint8_t  BS_jmpBoot[3];
     char     BS_OEMName[8];
@@ -56,6 +73,24 @@ struct BPB{
     void print();
 };
 
+// FAT32 replaces everything after BPB_TotSec32 (offset 36) with this layout.
+#define BPB_FAT32_OFFSET 36
+struct BPB_FAT32{
+    uint32_t BPB_FATSz32;
+    uint16_t BPB_ExtFlags;
+    uint16_t BPB_FSVer;
+    uint32_t BPB_RootClus;
+    uint16_t BPB_FSInfo;
+    uint16_t BPB_BkBootSec;
+    uint8_t  BPB_Reserved[12];
+    uint8_t  BS_DrvNum;
+    uint8_t  BS_Reserved1;
+    uint8_t  BS_BootSig;
+    uint32_t BS_VolID;
+    char     BS_VolLab[11];
+    char     BS_FilSysType[8];
+};
+
 
 
 
@@ -77,7 +112,13 @@ struct FileEntry{
     uint16_t DIR_FstClusLO;
     uint32_t DIR_FileSize;
 
-  
+    inline uint32_t FirstCluster()const{
+        return ((uint32_t)DIR_FstClusHI << 16) | DIR_FstClusLO;
+    }
+    inline void SetFirstCluster(uint32_t cluster){
+        DIR_FstClusHI = cluster >> 16;
+        DIR_FstClusLO = cluster & 0xffff;
+    }
 };
 
 
@@ -93,8 +134,9 @@ struct LongNameEntry{
 };
 
 
-#pragma pop
+#pragma pack(pop)
 static_assert(sizeof(BPB)==62);
+static_assert(sizeof(BPB_FAT32)==54);
 static_assert(sizeof(FileEntry)==32);
 
 const uint8_t Signature_word[2] = {0x55,0xAA};
@@ -102,24 +144,275 @@ const uint8_t Signature_word[2] = {0x55,0xAA};
 
 
 struct Directory{
-    uint16_t fat_entry;
+    uint32_t fat_entry;
 };
 
 struct FileHandle{
-    uint16_t direntry;
+    uint32_t direntry;
     uint16_t dirindex;
     
 };
 
+enum class AllocationPolicy{
+    FIRST_FIT,  // lowest free cluster
+    NEXT_FIT,   // first free cluster after the last allocation, wrapping
+    WEAR_AWARE  // free cluster in the least-flushed erase block
+};
+
+// Dirty tracking granularity, the smallest legal sector size.
+#define DIRTY_SECTOR_SIZE 512
+
+// Receives one coalesced dirty range per call. Return 0 on success; a
+// failed range stays dirty for the next Flush.
+typedef int (*FlushCallback)(void* context, size_t offset, const uint8_t* data, size_t length);
+
+// Receives one contiguous run of freed clusters per call, so the backing
+// store can punch a hole or erase ahead of time. Freed clusters are not
+// zeroed in the image while a discard callback is installed.
+typedef int (*DiscardCallback)(void* context, size_t offset, size_t length);
+
+// Asked to start fetching a range the reader will need soon, e.g. into a
+// sector cache or with an asynchronous block-device read.
+typedef void (*PrefetchCallback)(void* context, size_t offset, size_t length);
+
+// Upper bound of the read-ahead window in clusters. The window doubles on
+// every sequential Read until it reaches this.
+#ifndef FAT12_READAHEAD_CLUSTERS
+#define FAT12_READAHEAD_CLUSTERS 8
+#endif
+
+// Size of the open-file table. Handles opened on the same file share a slot.
+#ifndef FAT12_MAX_OPEN_FILES
+#define FAT12_MAX_OPEN_FILES 8
+#endif
+
+struct OpenFile{
+    FileHandle handle;
+    FileEntry entry;         // cached directory entry, written back on Close/Flush
+    uint8_t refcount;        // 0 means the slot is free
+    bool dirty;
+    bool preallocated;       // chain may run past the size, trimmed on the last Close
+
+    // Optional write-coalescing buffer supplied through SetWriteBuffer. It
+    // holds file bytes [writebufferstart, writebufferstart+writebufferfill)
+    // and never spans a cluster, so writebuffercluster is where they land.
+    uint8_t* writebuffer;
+    uint32_t writebuffersize;
+    uint32_t writebufferfill;
+    uint32_t writebufferstart;
+    uint32_t writebuffercluster;
+};
+
 struct FileIOHandle{
 
     FileHandle handle;
-    uint16_t currentoffset;
-    uint16_t currentAU;
+    uint8_t slot; // index into FAT12::openfiles
+    uint32_t currentoffset; // full 32-bit DIR_FileSize range
+    uint32_t currentAU;
     uint8_t mode;
+
+    // Read-ahead state: prefetch has been issued up to readaheadoffset,
+    // which starts in readaheadcluster.
+    uint32_t lastreadend;
+    uint32_t readaheadoffset;
+    uint32_t readaheadcluster;
+    uint8_t sequentialreads;
+    uint16_t id; // names the handle in a trace, never 0
+};
+
+typedef  uint32_t FatIterator;
+
+// Calls the trace recorder logs. The values are part of the trace format:
+// add new ones at the end.
+enum class TraceOp : uint8_t{
+    MOUNT,
+    MOUNT_STEP,            // arg budget, result 1 once done
+    MOUNT_READ_ONLY,       // arg entries, arg2 path bytes
+    SAVE_PATH_INDEX,       // arg entries, arg2 path bytes
+    CREATE_DIR,            // target parent, name 8.3 space-padded
+    CREATE_FILE,           // target parent, name 8.3 space-padded
+    CREATE_FILES,          // one record per name: target dir, arg count, arg2 position
+    DELETE_FILE,
+    RENAME,                // arg new parent, name
+    COPY_FILE,             // arg destination directory, name
+    REMOVE_TREE,           // arg cluster map words
+    CLEAR_CONTENTS,
+    PREALLOCATE,           // arg bytes
+    COMPACT_DIRECTORY,     // target dir, result clusters freed
+    OPEN,                  // arg mode, id of the new handle
+    OPEN_PATH,             // name, id of the new handle
+    LOOKUP_PATH,           // name
+    CLOSE,
+    FLUSH_FILE,
+    SYNC,
+    FLUSH,
+    READ,                  // arg bytes asked for, result bytes read
+    WRITE,                 // arg bytes given, result bytes written
+    SET_WRITE_BUFFER,      // arg buffer bytes
+    SET_ALLOCATION_POLICY, // arg AllocationPolicy, arg2 wear counter blocks
+    DEFRAGMENT,            // arg budget, arg2 directories, result clusters moved
+    GET_SHORT_NAME,        // target dir, name
+    GET_LONG_NAME,         // target dir, name
+    GET_FREE_SPACE,        // arg cluster bytes, result free clusters
+    FORMAT,                // name label, target root sectors, arg bytes per sector,
+                           // arg2 sectors per cluster | dual FATs << 8 | flags << 16
+    CHECK,                 // target repair, arg cluster map words, arg2 threads
+    ENABLE_DIRTY_TRACKING, // arg bitmap words, arg2 erase block bytes
+    FLUSH_RANGE,           // arg offset, arg2 length
+    COUNT
+};
+
+// One public call. Fields the call has no use for are 0. A trace file is
+// these records back to back, each followed by its namelength name bytes.
+struct TraceRecord{
+    uint32_t time;       // TraceClock when the call started
+    uint32_t duration;   // TraceClock ticks until it returned
+    uint8_t op;          // TraceOp
+    uint8_t status;      // Fat12Status returned
+    uint16_t id;         // FileIOHandle::id the call used or made
+    uint32_t target;     // FileHandle::direntry or Directory the call is about
+    uint16_t dirindex;   // FileHandle::dirindex
+    uint16_t namelength;
+    uint32_t arg;
+    uint32_t arg2;
+    uint32_t result;
+};
+static_assert(sizeof(TraceRecord)==32);
+
+// Timestamps for the trace, in any unit that suits the device
+// (microseconds, say). Only differences are used, so it may wrap.
+typedef uint32_t (*TraceClock)(void* context);
+
+// Receives every record; name holds record->namelength bytes.
+typedef void (*TraceCallback)(void* context, const TraceRecord* record, const char* name);
+
+enum class FatType{
+    FAT12,
+    FAT16,
+    FAT32
+};
+
+// Number of FAT entries decoded per block by the bulk scanners.
+#define FAT_DECODE_BLOCK 64
+
+struct FatStatistics{
+    uint32_t free;
+    uint32_t used;
+    uint32_t bad;
+    uint32_t endofchain;
+    uint32_t freeruns;
+    uint32_t largestfreerun;
+};
+
+// Problems found by FAT12::Check. Counters of one kind are events, not
+// clusters, except lostclusters and fatmismatches (in sectors).
+struct FsckReport{
+    uint32_t files;
+    uint32_t directories;
+    uint32_t lostclusters;      // allocated in the FAT but owned by no entry
+    uint32_t crosslinks;        // chains running into a cluster already owned (includes loops)
+    uint32_t badchains;         // chains pointing at free, bad or out-of-range clusters
+    uint32_t sizemismatches;    // DIR_FileSize disagreeing with the chain length
+    uint32_t orphanedlongnames; // long-name runs without a matching short entry
+    uint32_t baddotentries;
+    uint32_t fatmismatches;     // sectors where a FAT copy differs from the first FAT
+    uint32_t repaired;
+};
+
+struct FsckSubtree{
+    uint32_t cluster;
+    uint32_t clusters;
+};
+
+// State of one checker walk. Every thread has its own, sharing clustermap.
+struct FsckContext{
+    uint32_t* clustermap; // one bit per cluster, set once a chain owns it
+    bool repair;
+    bool atomic;
+    FsckSubtree* subtrees; // when set, root subdirectories are queued here instead of walked
+    size_t subtreecount;
+    size_t subtreecapacity;
+    FsckReport report;
+};
+
+#ifndef FAT12_FSCK_MAX_DEPTH
+#define FAT12_FSCK_MAX_DEPTH 32
+#endif
+
+// Free runs are bucketed by length: bucket b holds runs of 2^b to
+// 2^(b+1)-1 clusters, the last bucket everything longer.
+#define FRAGMENTATION_HISTOGRAM_BUCKETS 16
+
+struct FragmentationReport{
+    uint32_t files;
+    uint32_t directories;
+    uint32_t clusters;         // allocated to files and directories
+    uint32_t extents;          // contiguous pieces over all chains
+    uint32_t fragmentedchains; // chains with more than one extent
+    uint32_t maxextents;
+    uint32_t freeruns[FRAGMENTATION_HISTOGRAM_BUCKETS];
+};
+
+// Called for every file and directory by WalkTree, parents first. Return
+// false to stop the walk.
+typedef bool (*EntryVisitor)(void* context, FileHandle handle, FileEntry* entry);
+
+// Bits in the short-name filter of a CreateFiles call; lives on the stack.
+#ifndef FAT12_BATCH_BLOOM_BITS
+#define FAT12_BATCH_BLOOM_BITS 16384
+#endif
+// Candidates rejected on the filter alone before falling back to a lookup.
+#ifndef FAT12_BATCH_BLOOM_ATTEMPTS
+#define FAT12_BATCH_BLOOM_ATTEMPTS 64
+#endif
+
+// Position of a single forward pass over a directory's slots.
+struct SlotScanner{
+    FileHandle pos;
+    bool atend;
+    uint32_t last;        // last cluster of the directory, once atend
+    FileHandle runstart;  // free run carried between calls
+    size_t runlength;
 };
 
-typedef  uint16_t FatIterator;
+// Master boot record: four 16-byte entries, sizes in 512-byte sectors.
+#define MBR_PARTITION_TABLE_OFFSET 446
+#define MBR_PARTITION_ENTRIES 4
+#define MBR_SECTOR_SIZE 512
+
+// One FAT volume on a block device.
+struct Partition{
+    uint8_t type;  // MBR system id, 0 for a device without a partition table
+    bool bootable;
+    size_t offset; // bytes from the start of the device
+    size_t size;
+};
+
+// One file or directory of a read-only mount, found by its full path
+// ("dir/sub/name", no leading slash) in the caller's path pool.
+struct PathIndexEntry{
+    uint32_t path;        // offset into the path pool
+    uint16_t pathlength;
+    uint8_t attr;
+    uint8_t reserved;
+    uint32_t firstcluster;
+    uint32_t size;
+    uint32_t extents;
+    FileHandle handle;    // the short entry
+};
+
+// Saved path index in the root: header, entries, then the path pool.
+// Checking the stamp still reads every directory cluster, so loading it
+// only saves the sort and long-name assembly of a fresh build, not I/O.
+#define PATH_INDEX_NAME "PATHIDX IDX"
+#define PATH_INDEX_MAGIC 0x58444950 // "PIDX"
+
+struct PathIndexHeader{
+    uint32_t magic;
+    uint32_t stamp; // hash of every directory when it was saved
+    uint32_t count;
+    uint32_t pathsize;
+};
 
 enum class Fat12Status{
     OK,
@@ -131,6 +424,10 @@ enum class Fat12Status{
     DIRECTORY_NOT_EMPTY,
     LONGFILEENTRY_IS_CORRUPTED,
     FILE_DOES_NOT_EXIST,
+    TOO_MANY_OPEN_FILES,
+    FILE_IS_OPEN,
+    FILE_ALREADY_EXISTS,
+    READ_ONLY,
     END
 };
 
@@ -141,6 +438,24 @@ enum BytesPerSector{
     B4096=4096
 };
 
+// Format flags. A quick format clears only the boot sector, reserved
+// sectors, FATs and root directory. FORMAT_DISCARD also hands the data
+// area to the discard callback, if one is set.
+#define FORMAT_QUICK   0x01
+#define FORMAT_DISCARD 0x02
+
+// Format arguments suggested by FAT12::PlanGeometry.
+struct FormatGeometry{
+    BytesPerSector bytespersector;
+    uint8_t sectorspercluster;
+    bool dualfats;
+    size_t rootsectors; // SectorsInRootEntry, 0 on FAT32
+    FatType fattype;
+    uint32_t clusters;
+    uint32_t fatsectors;
+    uint64_t slack; // bytes left unused in the last clusters of the expected files
+};
+
 template<typename T>
 struct Result {
     int status;
@@ -159,22 +474,120 @@ class FAT12{
     uint8_t* disk;
     size_t disk_size;
     BPB bpb;
+    BPB_FAT32 bpb32; // only valid when fattype is FatType::FAT32
+    FatType fattype;
+    OpenFile openfiles[FAT12_MAX_OPEN_FILES];
+    uint32_t* dirtymap; // one bit per DIRTY_SECTOR_SIZE bytes of disk, caller-owned
+    size_t eraseblocksize;
+    void MarkDirty(size_t offset, size_t length);
+    bool RangeDirty(size_t firstsector, size_t sectors)const;
+    void ClearDirty(size_t firstsector, size_t sectors);
+    void WriteDisk(size_t offset, const void* src, size_t length);
+    void FillDisk(size_t offset, uint8_t value, size_t length);
+    Result<none> FlushRange(size_t offset, size_t length, FlushCallback callback, void* context);
+    AllocationPolicy allocationpolicy;
+    uint32_t nextfitcursor;
+    // Mount only reads the BPB. Free space is counted in MountStep slices
+    // or on first need; until then allocation starts at freehint.
+    uint32_t freehint; // every cluster below it is in use
+    uint32_t freecount; // free clusters below freescancursor
+    uint32_t freescancursor; // freecount is exact once this reaches the end
+    void ResetAllocationState();
+    Result<bool> ScanFreeClusters(size_t budget);
+    uint32_t* wearcounts; // Flush writes per erase block, caller-owned so it can be persisted
+    size_t wearcountblocks;
+    uint32_t wearcursor; // next cluster to try in erase block wearblock, 0 for none
+    size_t wearblock;
+    Result<uint32_t> GetLeastWornFreeCluster();
+    DiscardCallback discardcallback;
+    void* discardcontext;
+    Result<none> FreeClusterChain(uint32_t first);
+    Result<none> ReleaseClusterRun(uint32_t first, uint32_t count);
+    Result<none> TrimChain(uint32_t first, uint32_t keep);
+    Result<none> ReleaseClusterMap(const uint32_t* clustermap, size_t clustermapwords);
+    PrefetchCallback prefetchcallback;
+    void* prefetchcontext;
+    void ReadAhead(FileIOHandle& file, const FileEntry& entry);
+    static bool ClaimCluster(FsckContext& ctx, uint32_t cluster);
+    uint32_t CheckChain(FsckContext& ctx, uint32_t first, bool* firstbad);
+    Result<none> CheckDirectory(FsckContext& ctx, uint32_t cluster, uint32_t clusters, unsigned depth);
+    void CheckDotEntries(FsckContext& ctx, uint32_t cluster, uint32_t parent);
+    void CheckFileSize(FsckContext& ctx, FileEntry* entry, uint32_t length);
+    void ReleaseOrphanedLongName(FsckContext& ctx, FileHandle first, size_t count);
+    void CheckFatCopies(FsckContext& ctx);
+    void CheckLostClusters(FsckContext& ctx);
+    Result<bool> WalkTree(uint32_t cluster, unsigned depth, EntryVisitor visitor, void* context);
+    uint32_t CountExtents(uint32_t first, uint32_t* clusters);
+    Result<none> FlushFatRange(uint32_t first, uint32_t last, FlushCallback callback, void* context);
+    bool ChainHasOpenEntries(uint32_t first);
+    Result<none> RelocateSegment(FileHandle* owner, uint32_t prev, uint32_t first, uint32_t count, uint32_t target, FlushCallback callback, void* context);
+    Result<none> RetargetDotEntries(uint32_t cluster);
+    Result<uint32_t> DefragmentChain(FileHandle* owner, uint32_t first, bool keepfirst, uint32_t budget, FlushCallback callback, void* context);
+    uint32_t defragcursor; // walk position of the next chain Defragment looks at
+    TraceCallback tracecallback;
+    TraceClock traceclock;
+    void* tracecontext;
+    uint8_t tracedepth; // calls made from inside a public call are not traced
+    uint16_t lastfileid;
+    uint32_t TraceBegin();
+    void TraceEnd(uint32_t start, TraceOp op, int status, uint16_t id, FileHandle target, uint32_t arg, uint32_t arg2, uint32_t result, const char* name = nullptr, size_t namelength = 0);
+    bool readonly;
+    PathIndexEntry* pathindex; // caller-owned, sorted by path once built
+    size_t pathindexcapacity;
+    size_t pathindexcount;
+    char* pathpool;
+    size_t pathpoolcapacity;
+    size_t pathpoolsize;
+    bool pathindexready;
+    Result<none> EnsurePathIndex();
+    int ComparePath(const PathIndexEntry& entry, const char* path, size_t len)const;
+    void SortPathIndex();
+    Result<none> IndexDirectory(uint32_t cluster, uint32_t prefix, uint16_t prefixlength, unsigned depth);
+    Result<none> BuildPathIndex(PathIndexEntry* entries, size_t capacity, char* paths, size_t pathcapacity);
+    Result<none> LoadPathIndex();
+    Result<none> WritePathIndex();
+    uint32_t HashChain(uint32_t hash, uint32_t first);
+    uint32_t PathIndexStamp();
+    OpenFile* FindOpenFile(FileHandle filehandle);
+    Result<OpenFile*> AcquireOpenFile(FileHandle filehandle, const FileEntry* known = nullptr);
+    Result<OpenFile*> GetOpenFile(const FileIOHandle& file);
+    Result<none> WriteBackOpenFile(OpenFile* openfile);
+    Result<none> CommitWriteBuffer(OpenFile* openfile, FileIOHandle* file);
+    Result<size_t> WriteThrough(FileIOHandle& file,const uint8_t * buffer, size_t buffersize);
     Result<uint16_t> GetFAT12_entry(size_t index);
-    Result<uint16_t> GetFAT12_reverse_entry(size_t value);
     Result<none> SetFAT12_entry(size_t index,uint16_t value);
+    Result<uint32_t> GetFAT_entry(size_t index);
+    Result<uint32_t> GetFAT_reverse_entry(uint32_t value);
+    Result<none> SetFAT_entry(size_t index,uint32_t value);
+    void WriteFatBytes(size_t offset_in_fat, const void* src, size_t len);
+    static void DecodeFAT12Pairs(const uint8_t* src, size_t pairs, uint16_t* out);
+    Result<none> DecodeFatEntries(size_t first, uint32_t* out, size_t count);
+    Result<uint32_t> FindFatEntry(uint32_t value, size_t start);
+    Result<uint32_t> FindFreeRun(size_t length, size_t start);
+    Result<uint32_t> LargestFreeRun(uint32_t* length);
     Result<none> ReadFirst512bytes(BPB*out);
     static bool IsFAT12(const BPB*bpb);
+    static bool IsBootSector(const uint8_t* sector);
+    static Result<FatType> DetermineFatType(const BPB*bpb, const BPB_FAT32*bpb32);
+    static Result<FatType> LayoutVolume(BPB*bpb, BPB_FAT32*bpb32, size_t totalsectors, size_t rootentries);
     Result<none> InitFAT();
     FatIterator IterateFat(FatIterator* it);
     Result<none> InitRootDir();
-    Result<uint16_t> GetNextFreeCluster();
-    Result<none> ClearCluster(uint16_t index);
-    Result<size_t> OffsetToCluster(uint16_t index);
+    Result<uint32_t> GetNextFreeCluster();
+    Result<none> ClearCluster(uint32_t index);
+    Result<size_t> OffsetToCluster(uint32_t index);
     Result<size_t> OffsetToFileHandle(FileHandle filehandle);
     Result<FileHandle> GetNextEntryInDir(FileHandle fh);
     Result<FileHandle> GetPreviousEntryInDir(FileHandle fh);
 
-    inline size_t GetSizeOfCluster(uint16_t cluster)const;
+    inline size_t GetSizeOfCluster(uint32_t cluster)const;
+    inline uint32_t DirCluster(uint32_t cluster)const;
+    inline uint32_t EndOfChain()const;
+    inline bool IsEndOfChain(uint32_t value)const;
+    inline uint32_t BadCluster()const;
+    inline uint32_t FatSectors()const;
+    inline uint32_t TotalSectors()const;
+    inline uint32_t FirstDataSector()const;
     inline size_t OffsetToFat()const;
     inline size_t OffsetToRootDir()const;
     inline size_t OffsetToFirstCluster()const;
@@ -189,44 +602,162 @@ class FAT12{
     bool DirIsDotOrDotDot(FileEntry *fileentry);
 
 
+    static void ShortNameCandidate(char* shortname_out, const char* longname, size_t longname_len, size_t attempt);
     Result<none> CreateShortNameFromLongName(char* shortname_out, const char* longname, size_t longname_len,Directory dir);
     Result<none> ShortNameifyIfValid(char* shortname_out,const char* longname,size_t longname_len);
      
     uint8_t LongNameChecksum(const char shortname[SHORTNAME_LEN]);
 
     Result<none> CreateLongFileNameEntry(const char* name, size_t len, Directory dir, FileHandle* filehandle);
+    Result<none> WriteLongFileNameEntryAt(const char* name, size_t len, const FileEntry* entry, FileHandle first, FileHandle* filehandle);
     Result<none> AllocateMultipleEntriesInDir(Directory dir,size_t count,FileHandle* first, FileHandle* last);
+    bool NextFreeSlots(SlotScanner& scanner, size_t slots, uint32_t* bloom, FileHandle* first);
+    Result<uint32_t> TakeBatchCluster(uint32_t runstart, uint32_t index, uint32_t* cursor);
 
     Result<FileHandle> GetShortNameInDir(Directory dir, const char* shortname, size_t shortname_len);
     Result<FileHandle> GetLongNameInDir(Directory dir, const char* longname, size_t longname_len);
+    Result<FileHandle> FindLongNameStart(FileHandle filehandle);
+    Result<bool> DirectoryIsWithin(Directory dir, uint32_t ancestor);
+
+private:
+    // Bodies of the traced public calls.
+    Result<none> MountUntraced();
+    Result<bool> MountStepUntraced(size_t budget);
+    Result<none> MountReadOnlyUntraced(PathIndexEntry* entries, size_t capacity, char* paths, size_t pathcapacity);
+    Result<none> SavePathIndexUntraced(PathIndexEntry* entries, size_t capacity, char* paths, size_t pathcapacity);
+    Result<none> CreateDirUntraced(const char name[8],const char extension[3],Directory parent,FileHandle* filehandle);
+    Result<none> CreateFileUntraced(const char name[8],const char extension[3],Directory parent,FileHandle* filehandle);
+    Result<size_t> CreateFilesUntraced(Directory dir, const char* const* names, const size_t* lens, size_t count, FileHandle* out);
+    Result<none> DeleteFileUntraced(FileHandle filehandle);
+    Result<none> RenameUntraced(FileHandle filehandle, Directory newparent, const char* name, size_t len, FileHandle* out);
+    Result<none> CopyFileUntraced(FileHandle src, Directory dstdir, const char* name, size_t len, FileHandle* out);
+    Result<none> RemoveTreeUntraced(FileHandle filehandle, uint32_t* clustermap, size_t clustermapwords);
+    Result<none> ClearContentsOfFileUntraced(FileHandle filehandle);
+    Result<none> PreallocateUntraced(FileHandle filehandle, size_t bytes);
+    Result<uint32_t> CompactDirectoryUntraced(Directory dir);
+    Result<FileIOHandle> OpenUntraced(FileHandle file, uint8_t mode);
+    Result<FileIOHandle> OpenPathUntraced(const char* path, size_t len);
+    Result<const PathIndexEntry*> LookupPathUntraced(const char* path, size_t len);
+    Result<none> CloseUntraced(FileIOHandle* file);
+    Result<none> FlushUntraced(FileIOHandle& file);
+    Result<none> SyncUntraced(FileIOHandle& file, FlushCallback callback, void* context);
+    Result<none> FlushUntraced(FlushCallback callback, void* context);
+    Result<size_t> ReadUntraced(FileIOHandle& file,uint8_t * buffer, size_t buffersize);
+    Result<size_t> WriteUntraced(FileIOHandle& file,const uint8_t * buffer, size_t buffersize);
+    Result<none> SetWriteBufferUntraced(FileIOHandle& file, uint8_t* buffer, size_t buffersize);
+    Result<none> SetAllocationPolicyUntraced(AllocationPolicy policy, uint32_t* wearcounts, size_t wearcountblocks);
+    Result<uint32_t> DefragmentUntraced(uint32_t budget, bool directories, FlushCallback callback, void* context);
+    Result<FileHandle> GetShortNameInDirUntraced(Directory dir, const char* shortname, size_t shortname_len);
+    Result<FileHandle> GetLongNameInDirUntraced(Directory dir, const char* longname, size_t longname_len);
+    uint64_t GetFreeDiskSpaceAmountUntraced();
+    Result<none> FormatUntraced(const char* volumename, BytesPerSector bytespersector,uint8_t SectorPerClusters, bool dual_FATs, size_t SectorsInRootEntry, uint8_t flags);
+    Result<FsckReport> CheckUntraced(uint32_t* clustermap, size_t clustermapwords, bool repair, unsigned threads);
+    Result<none> EnableDirtyTrackingUntraced(uint32_t* bitmap, size_t bitmapwords, size_t eraseblocksize);
+    Result<none> FlushRangeUntraced(size_t offset, size_t length, FlushCallback callback, void* context);
 public:
     FAT12(uint8_t* disk,size_t disk_size);
     
-    uint32_t GetFreeDiskSpaceAmount();
+    uint64_t GetFreeDiskSpaceAmount();
+    uint32_t CountFreeClusters();
+    FatStatistics GetFatStatistics();
+    Result<FragmentationReport> GetFragmentationReport();
+    Result<uint32_t> Defragment(uint32_t budget, bool directories, FlushCallback callback = nullptr, void* context = nullptr);
+    Result<FsckReport> Check(uint32_t* clustermap, size_t clustermapwords, bool repair, unsigned threads = 1);
     Result<none> AllocateNewEntryInDir(Directory dir, FileHandle* out_entry);
-    Result<none> Format(const char* volumename, BytesPerSector bytespersector,uint8_t SectorPerClusters, bool dual_FATs, size_t SectorsInRootEntry);
+    Result<none> Format(const char* volumename, BytesPerSector bytespersector,uint8_t SectorPerClusters, bool dual_FATs, size_t SectorsInRootEntry, uint8_t flags = 0);
+    static Result<size_t> ReadPartitionTable(const uint8_t* device, size_t device_size, Partition* out, size_t max);
+    static Result<FormatGeometry> PlanGeometry(size_t disk_size, BytesPerSector bytespersector, bool dual_FATs, const uint32_t* filesizes, size_t filecount);
     Result<none> CreateDir(const char name[8],const char extension[3],Directory parent,FileHandle* filehandle);
     Result<bool> DirectoryEmpty(Directory directory);
+    Result<uint32_t> CompactDirectory(Directory dir);
     Result<none> CreateFile(const char name[8],const char extension[3],Directory parent,FileHandle* filehandle);
+    Result<size_t> CreateFiles(Directory dir, const char* const* names, const size_t* lens, size_t count, FileHandle* out);
     Result<none> DeleteFile(FileHandle filehandle);
+    Result<none> Rename(FileHandle filehandle, Directory newparent, const char* name, size_t len, FileHandle* out);
+    Result<none> CopyFile(FileHandle src, Directory dstdir, const char* name, size_t len, FileHandle* out);
+    Result<none> RemoveTree(FileHandle filehandle, uint32_t* clustermap, size_t clustermapwords);
     Result<none> ClearContentsOfFile(FileHandle filehandle);
+    Result<none> Preallocate(FileHandle filehandle, size_t bytes);
     Result<FileIOHandle> Open(FileHandle file, uint8_t mode);
     Result<none> Close(FileIOHandle* file);
+    Result<none> Flush(FileIOHandle& file);
+    Result<none> SetWriteBuffer(FileIOHandle& file, uint8_t* buffer, size_t buffersize);
+    Result<none> EnableDirtyTracking(uint32_t* bitmap, size_t bitmapwords, size_t eraseblocksize);
+    Result<none> Flush(FlushCallback callback, void* context);
+    Result<none> Sync(FileIOHandle& file, FlushCallback callback, void* context);
+    void SetDiscardCallback(DiscardCallback callback, void* context);
+    void SetPrefetchCallback(PrefetchCallback callback, void* context);
+    void SetTraceCallback(TraceCallback callback, TraceClock clock, void* context);
+    Result<none> SetAllocationPolicy(AllocationPolicy policy, uint32_t* wearcounts = nullptr, size_t wearcountblocks = 0);
     Result<size_t> Read(FileIOHandle& file,uint8_t * buffer, size_t buffersize);
     Result<size_t> Write(FileIOHandle& file,const uint8_t * buffer, size_t buffersize);
     int SectorSerialDump(size_t index);
 
     Result<none> Mount();
+    Result<bool> MountStep(size_t budget);
+    Result<none> MountReadOnly(PathIndexEntry* entries, size_t capacity, char* paths, size_t pathcapacity);
+    Result<none> SavePathIndex(PathIndexEntry* entries, size_t capacity, char* paths, size_t pathcapacity);
+    Result<const PathIndexEntry*> LookupPath(const char* path, size_t len);
+    Result<FileIOHandle> OpenPath(const char* path, size_t len);
 
 
 };
-inline size_t FAT12::GetSizeOfCluster(uint16_t cluster)const
+inline size_t FAT12::GetSizeOfCluster(uint32_t cluster)const
 {
-    if(cluster == 0){
+    if(cluster == 0 && fattype != FatType::FAT32){
         return RootDirSize();
     }
     return GetAllocationUnitSize() ;
 }
+
+// Cluster 0 names the root directory. On FAT32 the root is an ordinary chain.
+inline uint32_t FAT12::DirCluster(uint32_t cluster)const
+{
+    if(cluster == 0 && fattype == FatType::FAT32){
+        return bpb32.BPB_RootClus;
+    }
+    return cluster;
+}
+
+inline uint32_t FAT12::EndOfChain()const
+{
+    switch(fattype){
+        case FatType::FAT16: return FAT16_END_OF_FILE;
+        case FatType::FAT32: return FAT32_END_OF_FILE;
+        default: return END_OF_FILE;
+    }
+}
+
+inline bool FAT12::IsEndOfChain(uint32_t value)const
+{
+    return value >= (EndOfChain() & ~7u);
+}
+
+inline uint32_t FAT12::BadCluster()const
+{
+    return (EndOfChain() & ~7u) - 1;
+}
+
+inline uint32_t FAT12::FatSectors()const
+{
+    if(bpb.BPB_FATSz16 != 0){
+        return bpb.BPB_FATSz16;
+    }
+    return bpb32.BPB_FATSz32;
+}
+
+inline uint32_t FAT12::TotalSectors()const
+{
+    if(bpb.BPB_TotSec16 != 0){
+        return bpb.BPB_TotSec16;
+    }
+    return bpb.BPB_TotSec32;
+}
+
+inline uint32_t FAT12::FirstDataSector()const
+{
+    return bpb.BPB_RsvdSecCnt + bpb.BPB_NumFATs * FatSectors() + (RootDirSize() + bpb.BPB_BytsPerSec - 1) / bpb.BPB_BytsPerSec;
+}
 inline size_t FAT12::OffsetToFat() const
 {
     return bpb.BPB_RsvdSecCnt * bpb.BPB_BytsPerSec;
@@ -239,7 +770,7 @@ inline size_t FAT12::OffsetToRootDir()const
 
 inline size_t FAT12::OffsetToFirstCluster()const
 {
-    return OffsetToRootDir()+RootDirSize();
+    return (size_t)FirstDataSector() * bpb.BPB_BytsPerSec;
 }
 
 inline size_t FAT12::RootDirSize()const
@@ -249,12 +780,12 @@ inline size_t FAT12::RootDirSize()const
 
 inline size_t FAT12::FatSize()const
 {
-    return bpb.BPB_NumFATs * bpb.BPB_FATSz16 * bpb.BPB_BytsPerSec;
+    return (size_t)bpb.BPB_NumFATs * FatSectors() * bpb.BPB_BytsPerSec;
 }
 
 inline size_t FAT12::GetNumberOfValidFatEntries()const
 {
-    return (bpb.BPB_TotSec16*bpb.BPB_BytsPerSec - OffsetToFirstCluster())/(bpb.BPB_SecPerClus*bpb.BPB_BytsPerSec) + 2;
+    return (TotalSectors() - FirstDataSector())/bpb.BPB_SecPerClus + 2;
 }
 
 inline size_t FAT12::GetAllocationUnitSize() const
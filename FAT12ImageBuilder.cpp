@@ -0,0 +1,327 @@
+#include "FAT12ImageBuilder.h"
+
+#if defined(__linux__)
+
+#include <algorithm>
+#include <set>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Long-name slots plus the short entry, as WriteLongFileNameEntryAt lays them out.
+static size_t SlotsForName(const std::string& name)
+{
+    return (name.size() - 1)/13 + 2;
+}
+
+FAT12ImageBuilder::FAT12ImageBuilder():files(0),directories(0)
+{
+    root.directory = true;
+    root.size = 0;
+    root.entries = 1; // volume label
+    root.firstcluster = 0;
+    root.clusters = 0;
+}
+
+Result<none> FAT12ImageBuilder::AddTree(const char *sourcedir)
+{
+    if(!sourcedir)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    root.path = sourcedir;
+    root.children.clear();
+    root.entries = 1;
+    files = 0;
+    directories = 0;
+    return Scan(root);
+}
+
+Result<none> FAT12ImageBuilder::Scan(Node &dir)
+{
+    DIR* d = opendir(dir.path.c_str());
+    if(!d)return {(int)Fat12Status::FILE_DOES_NOT_EXIST};
+    for(struct dirent* de = readdir(d); de; de = readdir(d)){
+        if(strcmp(de->d_name,".") == 0 || strcmp(de->d_name,"..") == 0)continue;
+        Node child;
+        child.name = de->d_name;
+        child.path = dir.path + "/" + child.name;
+        struct stat st;
+        if(stat(child.path.c_str(),&st) != 0){
+            closedir(d);
+            return {(int)Fat12Status::ERROR};
+        }
+        if(!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))continue;
+        if(child.name.size() > 255 || st.st_size > 0xffffffffLL){
+            closedir(d);
+            return {(int)Fat12Status::INDEX_OUT_OF_RANGE};
+        }
+        child.directory = S_ISDIR(st.st_mode);
+        child.size = child.directory ? 0 : st.st_size;
+        child.entries = 2; // "." and ".."
+        child.firstcluster = 0;
+        child.clusters = 0;
+        dir.entries += SlotsForName(child.name);
+        dir.children.push_back(child);
+    }
+    closedir(d);
+
+    // Sorted, so the same tree always gives the same image.
+    std::sort(dir.children.begin(),dir.children.end(),[](const Node& a, const Node& b){return a.name < b.name;});
+    for(Node& child : dir.children){
+        if(!child.directory){
+            files++;
+            continue;
+        }
+        directories++;
+        auto scanned = Scan(child);
+        if(!scanned.Ok())return scanned;
+    }
+    return {(int)Fat12Status::OK};
+}
+
+// Files get at least one cluster, as CreateFile would give them.
+void FAT12ImageBuilder::SizeDirectories(Node &dir, size_t clustersize)
+{
+    size_t bytes = dir.directory ? dir.entries*sizeof(FileEntry) : dir.size;
+    dir.clusters = MAX((bytes + clustersize - 1)/clustersize,(size_t)1);
+    for(Node& child : dir.children){
+        SizeDirectories(child,clustersize);
+    }
+}
+
+// A directory's files and subdirectories follow each other in entry order,
+// and the subtrees come after that, so reading a directory front to back
+// walks forward through the image.
+void FAT12ImageBuilder::AssignClusters(Node &dir, uint32_t *cursor, std::vector<Node*> &order)
+{
+    for(Node& child : dir.children){
+        child.firstcluster = *cursor;
+        *cursor += child.clusters;
+        if(!child.directory)order.push_back(&child);
+    }
+    for(Node& child : dir.children){
+        if(child.directory)AssignClusters(child,cursor,order);
+    }
+}
+
+Result<FormatGeometry> FAT12ImageBuilder::Plan(size_t *imagesize, BytesPerSector bytespersector, bool dual_FATs)
+{
+    if(!imagesize)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+
+    // Directories are charged like files holding their entries; the root is
+    // left out, PlanGeometry accounts for it.
+    std::vector<uint32_t> sizes;
+    std::vector<const Node*> stack{&root};
+    uint64_t total = 0;
+    while(!stack.empty()){
+        const Node* node = stack.back();
+        stack.pop_back();
+        for(const Node& child : node->children){
+            uint32_t bytes = child.directory ? child.entries*sizeof(FileEntry) : child.size;
+            sizes.push_back(bytes);
+            total += MAX((uint64_t)(bytes + bytespersector - 1)/bytespersector,(uint64_t)1)*bytespersector;
+            if(child.directory)stack.push_back(&child);
+        }
+    }
+
+    bool grow = *imagesize == 0;
+    size_t size = grow ? total + root.entries*sizeof(FileEntry) + 64*1024 : *imagesize;
+    while(true){
+        auto planned = FAT12::PlanGeometry(size,bytespersector,dual_FATs,sizes.data(),sizes.size());
+        if(planned.Ok()){
+            FormatGeometry geometry = planned.val;
+            size_t clustersize = (size_t)geometry.sectorspercluster*bytespersector;
+            // The root region must hold every root entry on FAT12/16.
+            if(geometry.fattype != FatType::FAT32){
+                size_t needed = (root.entries*sizeof(FileEntry) + bytespersector - 1)/bytespersector;
+                geometry.rootsectors = MAX(geometry.rootsectors,needed);
+            }
+            BPB bpb;
+            BPB_FAT32 bpb32;
+            memset(&bpb,0,sizeof(bpb));
+            memset(&bpb32,0,sizeof(bpb32));
+            bpb.BPB_BytsPerSec = bytespersector;
+            bpb.BPB_SecPerClus = geometry.sectorspercluster;
+            bpb.BPB_NumFATs = dual_FATs ? 2 : 1;
+            size_t rootentries = geometry.rootsectors*bytespersector/sizeof(FileEntry);
+            auto type = FAT12::LayoutVolume(&bpb,&bpb32,size/bytespersector,MAX(rootentries,(size_t)1));
+            if(type.Ok() && type.val == geometry.fattype && rootentries <= 0xffff){
+                FAT12 probe(nullptr,size);
+                probe.bpb = bpb;
+                probe.bpb32 = bpb32;
+                probe.fattype = type.val;
+                SizeDirectories(root,clustersize);
+                uint64_t needed = 0;
+                std::vector<const Node*> nodes{&root};
+                while(!nodes.empty()){
+                    const Node* node = nodes.back();
+                    nodes.pop_back();
+                    if(node != &root || type.val == FatType::FAT32)needed += node->clusters;
+                    for(const Node& child : node->children)nodes.push_back(&child);
+                }
+                geometry.clusters = probe.GetNumberOfValidFatEntries() - 2;
+                geometry.fatsectors = probe.FatSectors();
+                if(needed <= geometry.clusters){
+                    *imagesize = size;
+                    return {(int)Fat12Status::OK,geometry};
+                }
+            }
+        }else if(planned.status != (int)Fat12Status::OUT_OF_SPACE){
+            return {planned.status};
+        }
+        if(!grow || size > ((size_t)1 << 40))return {(int)Fat12Status::OUT_OF_SPACE};
+        size += MAX(size/16,(size_t)bytespersector);
+        size -= size % bytespersector;
+    }
+}
+
+Result<none> FAT12ImageBuilder::WriteDirectory(FAT12 &volume, Node &dir, uint32_t parent)
+{
+    uint32_t self = &dir == &root ? 0 : dir.firstcluster;
+    FileHandle slot{self,0};
+    if(&dir == &root){
+        slot.dirindex = 1; // after the volume label
+    }else{
+        FileEntry dot;
+        memset(&dot,0,sizeof(dot));
+        memset(dot.DIR_Name,0x20,SHORTNAME_LEN);
+        dot.DIR_Name[0] = '.';
+        dot.DIR_Attr = ATTR_DIRECTORY;
+        dot.SetFirstCluster(self);
+        auto offset = volume.OffsetToFileHandle(FileHandle{self,0});
+        if(!offset.Ok())return {offset.status};
+        volume.WriteDisk(offset.val,&dot,sizeof(dot));
+        dot.DIR_Name[1] = '.';
+        dot.SetFirstCluster(parent);
+        volume.WriteDisk(offset.val + sizeof(dot),&dot,sizeof(dot));
+        slot.dirindex = 2;
+    }
+
+    std::set<std::string> shortnames;
+    for(size_t i = 0; i < dir.children.size(); i++){
+        Node& child = dir.children[i];
+        FileEntry entry;
+        memset(&entry,0,sizeof(entry));
+        for(size_t attempt = 0; ; attempt++){
+            FAT12::ShortNameCandidate(entry.DIR_Name,child.name.data(),child.name.size(),attempt);
+            if(shortnames.insert(std::string(entry.DIR_Name,SHORTNAME_LEN)).second)break;
+        }
+        entry.DIR_Attr = child.directory ? ATTR_DIRECTORY : ATTR_ARCHIVE;
+        entry.SetFirstCluster(child.firstcluster);
+        entry.DIR_FileSize = child.size;
+
+        FileHandle written;
+        auto result = volume.WriteLongFileNameEntryAt(child.name.data(),child.name.size(),&entry,slot,&written);
+        if(!result.Ok())return result;
+        if(i + 1 < dir.children.size()){
+            auto next = volume.GetNextEntryInDir(written);
+            if(!next.Ok())return {next.status};
+            slot = next.val;
+        }
+    }
+
+    for(Node& child : dir.children){
+        if(!child.directory)continue;
+        auto result = WriteDirectory(volume,child,self);
+        if(!result.Ok())return result;
+    }
+    return {(int)Fat12Status::OK};
+}
+
+Result<none> FAT12ImageBuilder::Write(const char *imagepath, const char *volumename, size_t imagesize, const FormatGeometry &geometry)
+{
+    if(!imagepath || !volumename)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    int fd = open(imagepath,O_RDWR|O_CREAT|O_TRUNC,0644);
+    if(fd < 0)return {(int)Fat12Status::ERROR};
+    if(ftruncate(fd,imagesize) != 0){
+        close(fd);
+        return {(int)Fat12Status::ERROR};
+    }
+    void* addr = mmap(nullptr,imagesize,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    if(addr == MAP_FAILED){
+        close(fd);
+        return {(int)Fat12Status::ERROR};
+    }
+    uint8_t* map = (uint8_t*)addr;
+
+    Result<none> result{(int)Fat12Status::OK};
+    FAT12 volume(map,imagesize);
+    std::vector<Node*> order;
+    do{
+        // The file is fresh and reads as zeros, so only metadata needs writing.
+        result = volume.Format(volumename,geometry.bytespersector,geometry.sectorspercluster,geometry.dualfats,geometry.rootsectors,FORMAT_QUICK);
+        if(!result.Ok())break;
+
+        SizeDirectories(root,volume.GetAllocationUnitSize());
+        uint32_t cursor = 2;
+        if(volume.fattype == FatType::FAT32){
+            root.firstcluster = volume.bpb32.BPB_RootClus;
+            cursor = root.firstcluster + root.clusters;
+        }
+        AssignClusters(root,&cursor,order);
+        if(cursor > volume.GetNumberOfValidFatEntries()){
+            result = {(int)Fat12Status::OUT_OF_SPACE};
+            break;
+        }
+
+        std::vector<const Node*> nodes{&root};
+        while(!nodes.empty()){
+            const Node* node = nodes.back();
+            nodes.pop_back();
+            for(const Node& child : node->children)nodes.push_back(&child);
+            if(node->firstcluster < 2)continue;
+            for(uint32_t k = 0; k + 1 < node->clusters; k++){
+                volume.SetFAT_entry(node->firstcluster + k,node->firstcluster + k + 1);
+            }
+            volume.SetFAT_entry(node->firstcluster + node->clusters - 1,volume.EndOfChain());
+        }
+
+        result = WriteDirectory(volume,root,0);
+        if(!result.Ok())break;
+
+        // File data in cluster order: one forward pass over the image.
+        madvise(map,imagesize,MADV_SEQUENTIAL);
+        for(const Node* file : order){
+            auto offset = volume.OffsetToCluster(file->firstcluster);
+            if(!offset.Ok()){
+                result = {offset.status};
+                break;
+            }
+            int in = open(file->path.c_str(),O_RDONLY);
+            if(in < 0){
+                result = {(int)Fat12Status::FILE_DOES_NOT_EXIST};
+                break;
+            }
+            size_t done = 0;
+            while(done < file->size){
+                ssize_t got = read(in,map + offset.val + done,file->size - done);
+                if(got <= 0)break;
+                done += got;
+            }
+            close(in);
+            if(done != file->size){
+                result = {(int)Fat12Status::ERROR};
+                break;
+            }
+        }
+    }while(false);
+
+    if(result.Ok() && msync(map,imagesize,MS_SYNC) != 0){
+        result = {(int)Fat12Status::ERROR};
+    }
+    munmap(map,imagesize);
+    close(fd);
+    return result;
+}
+
+size_t FAT12ImageBuilder::Files() const
+{
+    return files;
+}
+
+size_t FAT12ImageBuilder::Directories() const
+{
+    return directories;
+}
+
+#endif
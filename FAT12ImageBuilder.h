@@ -0,0 +1,51 @@
+#ifndef FAT12IMAGEBUILDER_H
+#define FAT12IMAGEBUILDER_H
+
+#include "FAT12.h"
+
+#if defined(__linux__)
+
+#include <string>
+#include <vector>
+
+// Packs a host directory tree into a fresh image. The whole layout is
+// planned before anything is written: every directory is sized for its
+// entries up front and every file gets one contiguous extent, placed right
+// behind the directory that holds it. File data is then read straight into
+// the mapped image in ascending cluster order, so the image is written in
+// one sequential pass.
+class FAT12ImageBuilder{
+    struct Node{
+        std::string name;
+        std::string path;
+        bool directory;
+        uint32_t size;
+        size_t entries;      // slots used in this directory, "." and ".." included
+        uint32_t firstcluster;
+        uint32_t clusters;
+        std::vector<Node> children;
+    };
+    Node root;
+    size_t files;
+    size_t directories;
+
+    Result<none> Scan(Node& dir);
+    void SizeDirectories(Node& dir, size_t clustersize);
+    void AssignClusters(Node& dir, uint32_t* cursor, std::vector<Node*>& order);
+    Result<none> WriteDirectory(FAT12& volume, Node& dir, uint32_t parent);
+public:
+    FAT12ImageBuilder();
+
+    Result<none> AddTree(const char* sourcedir);
+    // Picks a geometry for imagesize bytes, or for the smallest image the
+    // tree fits in when imagesize is 0.
+    Result<FormatGeometry> Plan(size_t* imagesize, BytesPerSector bytespersector, bool dual_FATs);
+    Result<none> Write(const char* imagepath, const char* volumename, size_t imagesize, const FormatGeometry& geometry);
+
+    size_t Files()const;
+    size_t Directories()const;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,109 @@
+#include "FAT12MappedImage.h"
+
+#if defined(__linux__)
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+FAT12MappedImage::FAT12MappedImage():fd(-1),map(nullptr),map_size(0),writable(false),dirtymap(nullptr),volume(nullptr)
+{
+
+}
+
+FAT12MappedImage::~FAT12MappedImage()
+{
+    Close();
+}
+
+Result<none> FAT12MappedImage::Open(const char *path, bool writable)
+{
+    if(!path)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    if(map)return {(int)Fat12Status::ERROR};
+
+    fd = open(path,writable ? O_RDWR : O_RDONLY);
+    if(fd < 0)return {(int)Fat12Status::ERROR};
+    struct stat st;
+    if(fstat(fd,&st) != 0 || st.st_size <= 0){
+        Close();
+        return {(int)Fat12Status::ERROR};
+    }
+    map_size = st.st_size;
+    void* addr = mmap(nullptr,map_size,writable ? PROT_READ|PROT_WRITE : PROT_READ,MAP_SHARED,fd,0);
+    if(addr == MAP_FAILED){
+        Close();
+        return {(int)Fat12Status::ERROR};
+    }
+    map = (uint8_t*)addr;
+    this->writable = writable;
+
+    volume = new FAT12(map,map_size);
+    // A PROT_READ mapping must never see a write; READ_ONLY instead.
+    auto mounted = writable ? volume->Mount() : volume->MountReadOnly(nullptr,0,nullptr,0);
+    if(!mounted.Ok()){
+        Close();
+        return mounted;
+    }
+
+    // Dirty ranges are rounded out to pages, the unit msync works in.
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t words = ((map_size + DIRTY_SECTOR_SIZE - 1)/DIRTY_SECTOR_SIZE + 31)/32;
+    dirtymap = new uint32_t[words];
+    auto tracking = volume->EnableDirtyTracking(dirtymap,words,pagesize);
+    if(!tracking.Ok()){
+        Close();
+        return tracking;
+    }
+
+    // The metadata is hit at random, file data is mostly streamed.
+    size_t datastart = volume->OffsetToFirstCluster() & ~(pagesize - 1);
+    madvise(map,datastart,MADV_RANDOM);
+    if(datastart < map_size){
+        madvise(map + datastart,map_size - datastart,MADV_SEQUENTIAL);
+    }
+    return {(int)Fat12Status::OK};
+}
+
+int FAT12MappedImage::SyncRange(void *context, size_t offset, const uint8_t *data, size_t length)
+{
+    FAT12MappedImage* image = (FAT12MappedImage*)context;
+    (void)data;
+    return msync(image->map + offset,length,MS_SYNC);
+}
+
+Result<none> FAT12MappedImage::Flush()
+{
+    if(!volume)return {(int)Fat12Status::ERROR};
+    if(!writable)return {(int)Fat12Status::OK};
+    return volume->Flush(SyncRange,this);
+}
+
+Result<none> FAT12MappedImage::Close()
+{
+    Result<none> result = {(int)Fat12Status::OK};
+    if(volume && writable && dirtymap){
+        result = Flush();
+    }
+    delete volume;
+    volume = nullptr;
+    delete[] dirtymap;
+    dirtymap = nullptr;
+    if(map){
+        munmap(map,map_size);
+        map = nullptr;
+    }
+    if(fd >= 0){
+        close(fd);
+        fd = -1;
+    }
+    map_size = 0;
+    return result;
+}
+
+FAT12* FAT12MappedImage::Volume()
+{
+    return volume;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef FAT12MAPPEDIMAGE_H
+#define FAT12MAPPEDIMAGE_H
+
+#include "FAT12.h"
+
+#if defined(__linux__)
+
+// Host-side mount of an image file. The file is mapped MAP_SHARED and the
+// mapping is handed to FAT12 as its disk, so nothing is read up front and
+// Flush only msyncs the pages FAT12 marked dirty.
+class FAT12MappedImage{
+    int fd;
+    uint8_t* map;
+    size_t map_size;
+    bool writable;
+    uint32_t* dirtymap;
+    FAT12* volume;
+
+    static int SyncRange(void* context, size_t offset, const uint8_t* data, size_t length);
+public:
+    FAT12MappedImage();
+    ~FAT12MappedImage();
+    // Owns the mapping and the volume.
+    FAT12MappedImage(const FAT12MappedImage&) = delete;
+    FAT12MappedImage& operator=(const FAT12MappedImage&) = delete;
+
+    Result<none> Open(const char* path, bool writable);
+    Result<none> Flush();
+    Result<none> Close();
+    FAT12* Volume();
+};
+
+#endif
+
+#endif
@@ -0,0 +1,134 @@
+#include "FAT12VolumeManager.h"
+
+#include <new>
+
+FAT12VolumeManager::FAT12VolumeManager(uint8_t *device, size_t device_size):device(device),device_size(device_size),count(0)
+{
+    memset(volumes,0,sizeof(volumes));
+}
+
+FAT12VolumeManager::~FAT12VolumeManager()
+{
+    Unmount();
+}
+
+void FAT12VolumeManager::Unmount()
+{
+    for(size_t i = 0; i < count; i++){
+        volumes[i].fat->~FAT12();
+    }
+    memset(volumes,0,sizeof(volumes));
+    count = 0;
+}
+
+Result<size_t> FAT12VolumeManager::Mount()
+{
+    Unmount();
+    Partition partitions[FAT12_MAX_VOLUMES];
+    auto found = FAT12::ReadPartitionTable(device,device_size,partitions,FAT12_MAX_VOLUMES);
+    if(!found.Ok())return found;
+
+    size_t mounted = 0;
+    for(size_t i = 0; i < found.val; i++){
+        MountedVolume& volume = volumes[i];
+        volume.partition = partitions[i];
+        volume.owner = this;
+        volume.fat = new (storage[i]) FAT12(device + partitions[i].offset,partitions[i].size);
+        if(volume.fat->Mount().Ok())mounted++;
+    }
+    count = found.val;
+    return {(int)Fat12Status::OK,mounted};
+}
+
+Result<none> FAT12VolumeManager::EnableDirtyTracking(uint32_t *bitmap, size_t bitmapwords, size_t eraseblocksize)
+{
+    if(!bitmap)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    if(eraseblocksize == 0)return {(int)Fat12Status::ERROR};
+    size_t needed = 0;
+    for(size_t i = 0; i < count; i++){
+        if(volumes[i].partition.offset % eraseblocksize != 0)return {(int)Fat12Status::ERROR};
+        needed += ((volumes[i].partition.size + DIRTY_SECTOR_SIZE - 1)/DIRTY_SECTOR_SIZE + 31)/32;
+    }
+    if(needed > bitmapwords)return {(int)Fat12Status::OUT_OF_SPACE};
+
+    for(size_t i = 0; i < count; i++){
+        size_t words = ((volumes[i].partition.size + DIRTY_SECTOR_SIZE - 1)/DIRTY_SECTOR_SIZE + 31)/32;
+        auto enabled = volumes[i].fat->EnableDirtyTracking(bitmap,words,eraseblocksize);
+        if(!enabled.Ok())return enabled;
+        bitmap += words;
+    }
+    return {(int)Fat12Status::OK};
+}
+
+// Moves a volume's dirty range to where it sits on the device.
+int FAT12VolumeManager::FlushToDevice(void *context, size_t offset, const uint8_t *data, size_t length)
+{
+    MountedVolume* volume = (MountedVolume*)context;
+#ifdef FAT12_HOST
+    std::lock_guard<std::mutex> guard(volume->owner->devicelock);
+#endif
+    return volume->callback(volume->context,volume->partition.offset + offset,data,length);
+}
+
+Result<none> FAT12VolumeManager::FlushVolume(MountedVolume &volume, FlushCallback callback, void *context)
+{
+#ifdef FAT12_HOST
+    std::lock_guard<std::mutex> guard(locks[&volume - volumes]);
+#endif
+    volume.callback = callback;
+    volume.context = context;
+    auto flushed = volume.fat->Flush(FlushToDevice,&volume);
+    volume.callback = nullptr;
+    volume.context = nullptr;
+    return flushed;
+}
+
+// Every volume is flushed even if one fails; the first failure is returned.
+Result<none> FAT12VolumeManager::Flush(FlushCallback callback, void *context)
+{
+    if(!callback)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    Result<none> result{(int)Fat12Status::OK};
+    for(size_t i = 0; i < count; i++){
+        auto flushed = FlushVolume(volumes[i],callback,context);
+        if(result.Ok() && !flushed.Ok())result = flushed;
+    }
+    return result;
+}
+
+Result<none> FAT12VolumeManager::Flush(size_t index, FlushCallback callback, void *context)
+{
+    if(index >= count)return {(int)Fat12Status::INDEX_OUT_OF_RANGE};
+    if(!callback)return {(int)Fat12Status::NULLPOINTER_PROVIDED};
+    return FlushVolume(volumes[index],callback,context);
+}
+
+size_t FAT12VolumeManager::Count()const
+{
+    return count;
+}
+
+FAT12 *FAT12VolumeManager::Volume(size_t index)
+{
+    if(index >= count)return nullptr;
+    return volumes[index].fat;
+}
+
+const Partition *FAT12VolumeManager::GetPartition(size_t index)const
+{
+    if(index >= count)return nullptr;
+    return &volumes[index].partition;
+}
+
+#ifdef FAT12_HOST
+FAT12 *FAT12VolumeManager::Lock(size_t index)
+{
+    if(index >= count)return nullptr;
+    locks[index].lock();
+    return volumes[index].fat;
+}
+
+void FAT12VolumeManager::Unlock(size_t index)
+{
+    if(index < count)locks[index].unlock();
+}
+#endif
@@ -0,0 +1,70 @@
+#ifndef FAT12VOLUMEMANAGER_H
+#define FAT12VOLUMEMANAGER_H
+
+#include "FAT12.h"
+
+#ifdef FAT12_HOST
+#include <mutex>
+#endif
+
+#ifndef FAT12_MAX_VOLUMES
+#define FAT12_MAX_VOLUMES MBR_PARTITION_ENTRIES
+#endif
+
+// Mounts every FAT volume of one block device, each a FAT12 over its own
+// slice of the device. The volumes share nothing but the dirty-tracking
+// budget handed to EnableDirtyTracking and the flush callback, which sees
+// device offsets. Discard and prefetch callbacks set on a volume itself
+// still see offsets within that volume.
+//
+// On host builds every volume has its own mutex: take it with Lock before
+// using the volume from more than one thread, so independent volumes can
+// be serviced in parallel. Flush takes the volume locks itself, and calls
+// into the flush callback are serialized.
+class FAT12VolumeManager{
+    struct MountedVolume{
+        FAT12* fat;
+        Partition partition;
+        FAT12VolumeManager* owner;
+        FlushCallback callback; // only set while the volume is flushed
+        void* context;
+    };
+    uint8_t* device;
+    size_t device_size;
+    size_t count;
+    MountedVolume volumes[FAT12_MAX_VOLUMES];
+    alignas(FAT12) uint8_t storage[FAT12_MAX_VOLUMES][sizeof(FAT12)];
+#ifdef FAT12_HOST
+    std::mutex locks[FAT12_MAX_VOLUMES];
+    std::mutex devicelock;
+#endif
+
+    static int FlushToDevice(void* context, size_t offset, const uint8_t* data, size_t length);
+    Result<none> FlushVolume(MountedVolume& volume, FlushCallback callback, void* context);
+    void Unmount();
+public:
+    FAT12VolumeManager(uint8_t* device, size_t device_size);
+    ~FAT12VolumeManager();
+    // The volumes live in storage, so a copy would point into this one's.
+    FAT12VolumeManager(const FAT12VolumeManager&) = delete;
+    FAT12VolumeManager& operator=(const FAT12VolumeManager&) = delete;
+
+    // val is the number of volumes that mounted. Partitions that did not
+    // still get their FAT12, so they can be formatted and mounted by hand.
+    Result<size_t> Mount();
+    // Splits bitmap between the volumes, each getting what its size needs.
+    // Partitions have to start on an erase block boundary.
+    Result<none> EnableDirtyTracking(uint32_t* bitmap, size_t bitmapwords, size_t eraseblocksize);
+    Result<none> Flush(FlushCallback callback, void* context);
+    Result<none> Flush(size_t index, FlushCallback callback, void* context);
+
+    size_t Count()const;
+    FAT12* Volume(size_t index);
+    const Partition* GetPartition(size_t index)const;
+#ifdef FAT12_HOST
+    FAT12* Lock(size_t index);
+    void Unlock(size_t index);
+#endif
+};
+
+#endif
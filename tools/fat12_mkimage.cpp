@@ -0,0 +1,39 @@
+// Builds an image from a host directory tree:
+//   fat12_mkimage <source dir> <image> [size in bytes] [volume label]
+// Without a size the image is made just big enough for the tree.
+#include "../FAT12ImageBuilder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char** argv)
+{
+    if(argc < 3){
+        fprintf(stderr,"usage: %s <source dir> <image> [size in bytes] [volume label]\n",argv[0]);
+        return 2;
+    }
+    size_t imagesize = argc > 3 ? strtoull(argv[3],nullptr,0) : 0;
+    const char* label = argc > 4 ? argv[4] : "NO NAME";
+
+    FAT12ImageBuilder builder;
+    auto added = builder.AddTree(argv[1]);
+    if(!added.Ok()){
+        fprintf(stderr,"cannot read %s (status %d)\n",argv[1],added.status);
+        return 1;
+    }
+    auto geometry = builder.Plan(&imagesize,B512,true);
+    if(!geometry.Ok()){
+        fprintf(stderr,"tree does not fit (status %d)\n",geometry.status);
+        return 1;
+    }
+    auto written = builder.Write(argv[2],label,imagesize,geometry.val);
+    if(!written.Ok()){
+        fprintf(stderr,"cannot write %s (status %d)\n",argv[2],written.status);
+        return 1;
+    }
+    const char* types[3] = {"FAT12","FAT16","FAT32"};
+    printf("%s: %zu files, %zu directories, %zu bytes, %s, %u bytes per cluster\n",
+        argv[2],builder.Files(),builder.Directories(),imagesize,types[(int)geometry.val.fattype],
+        (unsigned)(geometry.val.sectorspercluster*geometry.val.bytespersector));
+    return 0;
+}
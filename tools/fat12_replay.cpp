@@ -0,0 +1,363 @@
+// Replays a trace recorded through FAT12::SetTraceCallback against an image
+// and prints a latency histogram per call:
+//   fat12_replay <image> <trace> [result image]
+// The trace is TraceRecord after TraceRecord, each followed by its name
+// bytes. It must start on the image the device had when recording began;
+// the handles it holds are then the ones the replay creates. The image is
+// replayed in memory, with dirty tracking on and flushes going nowhere, so
+// only the file system's own work is timed and the image file is left as
+// it was. A call that returns another status than it did on the device
+// counts as diverged. Percentiles are the upper bound of their bucket;
+// the device mean is in the unit of the recording's TraceClock.
+#include "../FAT12.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#define HISTOGRAM_BUCKETS 32 // bucket b: 2^b to 2^(b+1)-1 ns
+
+static const char* opnames[(int)TraceOp::COUNT] = {
+    "Mount","MountStep","MountReadOnly","SavePathIndex","CreateDir","CreateFile",
+    "CreateFiles","DeleteFile","Rename","CopyFile","RemoveTree","ClearContents",
+    "Preallocate","CompactDirectory","Open","OpenPath","LookupPath","Close",
+    "Flush(file)","Sync","Flush","Read","Write","SetWriteBuffer",
+    "SetAllocationPolicy","Defragment","GetShortNameInDir","GetLongNameInDir",
+    "GetFreeDiskSpace","Format","Check","EnableDirtyTracking","FlushRange"
+};
+
+struct OpStats{
+    uint64_t calls;
+    uint64_t diverged;
+    uint64_t bytes;
+    uint64_t totalns;
+    uint64_t recorded; // sum of TraceRecord::duration, in the device's unit
+    uint64_t histogram[HISTOGRAM_BUCKETS];
+};
+
+static int Discard(void*, size_t, const uint8_t*, size_t)
+{
+    return 0;
+}
+
+static bool ReadFile(const char* path, std::vector<uint8_t>& out)
+{
+    FILE* f = fopen(path,"rb");
+    if(!f)return false;
+    fseek(f,0,SEEK_END);
+    long size = ftell(f);
+    fseek(f,0,SEEK_SET);
+    out.resize(size > 0 ? size : 0);
+    bool ok = size >= 0 && fread(out.data(),1,out.size(),f) == out.size();
+    fclose(f);
+    return ok;
+}
+
+static uint64_t Percentile(const OpStats& stats, double fraction)
+{
+    uint64_t want = (uint64_t)(stats.calls * fraction);
+    uint64_t seen = 0;
+    for(int b = 0; b < HISTOGRAM_BUCKETS; b++){
+        seen += stats.histogram[b];
+        if(seen > want)return (uint64_t)2 << b;
+    }
+    return (uint64_t)1 << HISTOGRAM_BUCKETS;
+}
+
+static void PrintNs(uint64_t ns)
+{
+    if(ns < 10000){
+        printf("%7lluns",(unsigned long long)ns);
+    }else if(ns < 10000000){
+        printf("%7.1fus",ns/1e3);
+    }else{
+        printf("%7.1fms",ns/1e6);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 3){
+        fprintf(stderr,"usage: %s <image> <trace> [result image]\n",argv[0]);
+        return 2;
+    }
+    std::vector<uint8_t> image,trace;
+    if(!ReadFile(argv[1],image)){
+        fprintf(stderr,"cannot read %s\n",argv[1]);
+        return 1;
+    }
+    if(!ReadFile(argv[2],trace)){
+        fprintf(stderr,"cannot read %s\n",argv[2]);
+        return 1;
+    }
+
+    FAT12 volume(image.data(),image.size());
+    // Tracking stays on unless the trace sets it up itself; every bitmap
+    // handed over is kept, as a failed call leaves the previous one in use.
+    std::vector<std::vector<uint32_t>> dirtymaps(1,std::vector<uint32_t>(image.size()/DIRTY_SECTOR_SIZE/32 + 1));
+    volume.EnableDirtyTracking(dirtymaps[0].data(),dirtymaps[0].size(),DIRTY_SECTOR_SIZE);
+
+    // Whatever the calls point at has to outlive them.
+    std::map<uint16_t,FileIOHandle> files;
+    std::map<uint16_t,std::vector<uint8_t>> writebuffers;
+    std::vector<PathIndexEntry> pathindex;
+    std::vector<char> pathpool;
+    std::vector<uint32_t> wearcounts;
+    std::vector<uint32_t> clustermap;
+    std::vector<uint8_t> data;
+    std::vector<std::string> batchnames;
+    std::vector<const char*> batchpointers;
+    std::vector<size_t> batchlengths;
+    std::vector<FileHandle> batchout;
+
+    std::vector<OpStats> stats((int)TraceOp::COUNT);
+    memset(stats.data(),0,stats.size()*sizeof(OpStats));
+    size_t records = 0;
+    size_t skipped = 0;
+    bool mounted = false;
+
+    size_t at = 0;
+    while(at + sizeof(TraceRecord) <= trace.size()){
+        TraceRecord record;
+        memcpy(&record,trace.data() + at,sizeof(record));
+        at += sizeof(record);
+        if(at + record.namelength > trace.size())break;
+        std::string name((const char*)trace.data() + at,record.namelength);
+        at += record.namelength;
+        records++;
+        if(record.op >= (uint8_t)TraceOp::COUNT){
+            skipped++;
+            continue;
+        }
+        TraceOp op = (TraceOp)record.op;
+
+        // A trace started after mount still needs a mounted volume.
+        if(!mounted && op != TraceOp::ENABLE_DIRTY_TRACKING){
+            if(op != TraceOp::MOUNT && op != TraceOp::MOUNT_READ_ONLY && op != TraceOp::FORMAT){
+                volume.Mount();
+            }
+            mounted = true;
+        }
+
+        if(op == TraceOp::CREATE_FILES){
+            if(record.arg2 == 0){
+                batchnames.clear();
+            }
+            batchnames.push_back(name);
+            if(batchnames.size() < record.arg)continue;
+            batchpointers.clear();
+            batchlengths.clear();
+            for(const std::string& n : batchnames){
+                batchpointers.push_back(n.c_str());
+                batchlengths.push_back(n.size());
+            }
+            batchout.resize(batchnames.size());
+        }
+        // Calls on a handle that was closed or never opened (id 0, as
+        // Close zeroes the handle) have nothing to replay against.
+        FileIOHandle* file = nullptr;
+        bool onfile = op == TraceOp::CLOSE || op == TraceOp::FLUSH_FILE || op == TraceOp::SYNC
+            || op == TraceOp::READ || op == TraceOp::WRITE || op == TraceOp::SET_WRITE_BUFFER;
+        if(onfile){
+            auto found = files.find(record.id);
+            if(record.id == 0 || found == files.end()){
+                skipped++;
+                continue;
+            }
+            file = &found->second;
+        }
+        if((op == TraceOp::READ || op == TraceOp::WRITE) && data.size() < record.arg){
+            data.resize(record.arg,0x5A);
+        }
+        FileHandle target{record.target,record.dirindex};
+        Directory dir{record.target};
+        FileHandle out;
+        int status = (int)Fat12Status::OK;
+        uint64_t bytes = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        switch(op){
+            case TraceOp::MOUNT:
+                status = volume.Mount().status;
+                break;
+            case TraceOp::MOUNT_STEP:
+                status = volume.MountStep(record.arg).status;
+                break;
+            case TraceOp::MOUNT_READ_ONLY:
+                pathindex.resize(record.arg);
+                pathpool.resize(record.arg2);
+                status = volume.MountReadOnly(pathindex.data(),pathindex.size(),pathpool.data(),pathpool.size()).status;
+                break;
+            case TraceOp::SAVE_PATH_INDEX:{
+                std::vector<PathIndexEntry> entries(record.arg);
+                std::vector<char> paths(record.arg2);
+                status = volume.SavePathIndex(entries.data(),entries.size(),paths.data(),paths.size()).status;
+                break;
+            }
+            case TraceOp::CREATE_DIR:
+                name.resize(SHORTNAME_LEN,' ');
+                status = volume.CreateDir(name.c_str(),name.c_str() + 8,dir,&out).status;
+                break;
+            case TraceOp::CREATE_FILE:
+                name.resize(SHORTNAME_LEN,' ');
+                status = volume.CreateFile(name.c_str(),name.c_str() + 8,dir,&out).status;
+                break;
+            case TraceOp::CREATE_FILES:
+                status = volume.CreateFiles(dir,batchpointers.data(),batchlengths.data(),batchnames.size(),batchout.data()).status;
+                break;
+            case TraceOp::DELETE_FILE:
+                status = volume.DeleteFile(target).status;
+                break;
+            case TraceOp::RENAME:
+                status = volume.Rename(target,{record.arg},name.c_str(),name.size(),&out).status;
+                break;
+            case TraceOp::COPY_FILE:
+                status = volume.CopyFile(target,{record.arg},name.c_str(),name.size(),&out).status;
+                break;
+            case TraceOp::REMOVE_TREE:
+                clustermap.assign(record.arg,0);
+                status = volume.RemoveTree(target,clustermap.data(),clustermap.size()).status;
+                break;
+            case TraceOp::CLEAR_CONTENTS:
+                status = volume.ClearContentsOfFile(target).status;
+                break;
+            case TraceOp::PREALLOCATE:
+                status = volume.Preallocate(target,record.arg).status;
+                break;
+            case TraceOp::COMPACT_DIRECTORY:
+                status = volume.CompactDirectory(dir).status;
+                break;
+            case TraceOp::OPEN:
+            case TraceOp::OPEN_PATH:{
+                auto opened = op == TraceOp::OPEN ? volume.Open(target,record.arg) : volume.OpenPath(name.c_str(),name.size());
+                status = opened.status;
+                if(opened.Ok() && record.id != 0)files[record.id] = opened.val;
+                break;
+            }
+            case TraceOp::LOOKUP_PATH:
+                status = volume.LookupPath(name.c_str(),name.size()).status;
+                break;
+            case TraceOp::CLOSE:
+                status = volume.Close(file).status;
+                break;
+            case TraceOp::FLUSH_FILE:
+                status = volume.Flush(*file).status;
+                break;
+            case TraceOp::SYNC:
+                status = volume.Sync(*file,Discard,nullptr).status;
+                break;
+            case TraceOp::FLUSH:
+                status = volume.Flush(Discard,nullptr).status;
+                break;
+            case TraceOp::READ:{
+                auto read = volume.Read(*file,data.data(),record.arg);
+                status = read.status;
+                if(read.Ok())bytes = read.val;
+                break;
+            }
+            case TraceOp::WRITE:{
+                auto written = volume.Write(*file,data.data(),record.arg);
+                status = written.status;
+                if(written.Ok())bytes = written.val;
+                break;
+            }
+            case TraceOp::SET_WRITE_BUFFER:{
+                std::vector<uint8_t>& buffer = writebuffers[record.id];
+                buffer.resize(record.arg);
+                status = volume.SetWriteBuffer(*file,record.arg ? buffer.data() : nullptr,record.arg).status;
+                break;
+            }
+            case TraceOp::SET_ALLOCATION_POLICY:
+                wearcounts.assign(record.arg2,0);
+                status = volume.SetAllocationPolicy((AllocationPolicy)record.arg,record.arg2 ? wearcounts.data() : nullptr,record.arg2).status;
+                break;
+            case TraceOp::DEFRAGMENT:
+                status = volume.Defragment(record.arg,record.arg2 != 0,Discard,nullptr).status;
+                break;
+            case TraceOp::GET_SHORT_NAME:
+                status = volume.GetShortNameInDir(dir,name.c_str(),name.size()).status;
+                break;
+            case TraceOp::GET_LONG_NAME:
+                status = volume.GetLongNameInDir(dir,name.c_str(),name.size()).status;
+                break;
+            case TraceOp::GET_FREE_SPACE:
+                volume.GetFreeDiskSpaceAmount();
+                break;
+            case TraceOp::FORMAT:
+                status = volume.Format(name.c_str(),(BytesPerSector)record.arg,record.arg2 & 0xff,(record.arg2 >> 8) & 1,
+                    record.target,(record.arg2 >> 16) & 0xff).status;
+                break;
+            case TraceOp::CHECK:
+                clustermap.assign(record.arg,0);
+                status = volume.Check(clustermap.data(),clustermap.size(),record.target != 0,record.arg2).status;
+                break;
+            case TraceOp::ENABLE_DIRTY_TRACKING:
+                dirtymaps.emplace_back(record.arg);
+                status = volume.EnableDirtyTracking(record.arg ? dirtymaps.back().data() : nullptr,record.arg,record.arg2).status;
+                break;
+            case TraceOp::FLUSH_RANGE:
+                status = volume.FlushRange(record.arg,record.arg2,Discard,nullptr).status;
+                break;
+            default:
+                break;
+        }
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+        if(op == TraceOp::CLOSE && status == (int)Fat12Status::OK){
+            files.erase(record.id);
+            writebuffers.erase(record.id);
+        }
+        OpStats& s = stats[record.op];
+        s.calls++;
+        s.bytes += bytes;
+        s.totalns += ns;
+        s.recorded += record.duration;
+        if(status != record.status)s.diverged++;
+        int bucket = 0;
+        while(bucket < HISTOGRAM_BUCKETS - 1 && (ns >> (bucket + 1)) != 0)bucket++;
+        s.histogram[bucket]++;
+    }
+
+    printf("%zu records, %zu skipped%s\n\n",records,skipped,at != trace.size() ? ", trace truncated" : "");
+    printf("%-20s %8s %8s %9s %9s %9s %12s %12s\n","call","count","diverged","mean","p50","p99","bytes","device mean");
+    for(int op = 0; op < (int)TraceOp::COUNT; op++){
+        const OpStats& s = stats[op];
+        if(s.calls == 0)continue;
+        printf("%-20s %8llu %8llu  ",opnames[op],(unsigned long long)s.calls,(unsigned long long)s.diverged);
+        PrintNs(s.totalns/s.calls);
+        printf("  ");
+        PrintNs(Percentile(s,0.5));
+        printf("  ");
+        PrintNs(Percentile(s,0.99));
+        printf(" %12llu %12.1f\n",(unsigned long long)s.bytes,(double)s.recorded/s.calls);
+    }
+    for(int op = 0; op < (int)TraceOp::COUNT; op++){
+        const OpStats& s = stats[op];
+        if(s.calls == 0)continue;
+        printf("\n%s\n",opnames[op]);
+        uint64_t most = 0;
+        for(int b = 0; b < HISTOGRAM_BUCKETS; b++)most = MAX(most,s.histogram[b]);
+        for(int b = 0; b < HISTOGRAM_BUCKETS; b++){
+            if(s.histogram[b] == 0)continue;
+            printf("  < ");
+            PrintNs((uint64_t)2 << b);
+            printf(" %8llu ",(unsigned long long)s.histogram[b]);
+            for(uint64_t i = 0; i < (s.histogram[b]*50 + most - 1)/most; i++)putchar('#');
+            putchar('\n');
+        }
+    }
+
+    if(argc > 3){
+        FILE* f = fopen(argv[3],"wb");
+        if(!f || fwrite(image.data(),1,image.size(),f) != image.size()){
+            fprintf(stderr,"cannot write %s\n",argv[3]);
+            if(f)fclose(f);
+            return 1;
+        }
+        fclose(f);
+    }
+    return 0;
+}